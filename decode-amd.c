@@ -2,89 +2,123 @@
  * Copyright 2023 Hovav Shacham.  All rights reserved; see LICENSE file.
  */
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+#define CACHELINE_BYTES 64
+#define IN_BYTES        256     /* payload of a block: 1 to 4 cachelines */
+#define OUT_BYTES       256
 
-static u8 in[64];
-static u8 in_byte_idx = 0;
-static u8 in_bit_idx  = 0;
+/*
+ * All decoding state lives here, so that surface mode can run one
+ * decoder per thread.  Malformed input is not a programming error:
+ * rather than assert, we record the first failed check and keep
+ * going; once a check has failed, read_bits returns zeros and the
+ * caller is expected to discard the output.
+ */
+struct amd_decoder {
+  const u8 *in;
+  u16 in_len;
+  u16 in_end;                   /* end of the cacheline being read */
+  u16 in_byte_idx;
+  u8 in_bit_idx;
+
+  u8 *out;
+  u8 out_idx;
+
+  const char *error;
+};
+
+#define check(d, cond)                                  \
+  do {                                                  \
+    if (!(cond) && (d)->error == NULL)                  \
+      (d)->error = #cond;                               \
+  } while (0)
+
+static void
+init_decoder(struct amd_decoder *d, const u8 *in, u16 in_len, u8 *out)
+{
+  d->in = in;
+  d->in_len = in_len;
+  d->in_end = in_len;
+  d->in_byte_idx = 0;
+  d->in_bit_idx = 0;
+  d->out = out;
+  d->out_idx = 0;
+  d->error = NULL;
+}
 
 static u8
-read_bits(u8 count)
+read_bits(struct amd_decoder *d, u8 count)
 {
   u8 retval = 0;
 
   assert(count <= 8);
-  assert(in_byte_idx < 64);
-
-  if (in_bit_idx + count < 8) {
-    retval = (in[in_byte_idx] >> in_bit_idx) & ((1 << count) - 1);
-    in_bit_idx += count;
-  } else if (in_bit_idx + count == 8) {
-    retval = (in[in_byte_idx] >> in_bit_idx);
-    in_byte_idx++; in_bit_idx = 0;
+  check(d, d->in_byte_idx < d->in_end);
+  if (d->error != NULL)
+    return 0;
+
+  if (d->in_bit_idx + count < 8) {
+    retval = (d->in[d->in_byte_idx] >> d->in_bit_idx) & ((1 << count) - 1);
+    d->in_bit_idx += count;
+  } else if (d->in_bit_idx + count == 8) {
+    retval = (d->in[d->in_byte_idx] >> d->in_bit_idx);
+    d->in_byte_idx++; d->in_bit_idx = 0;
   } else {                      /* in_bit_idx + count > 8 */
-    u8 first_byte_bits  = 8 - in_bit_idx;
+    u8 first_byte_bits  = 8 - d->in_bit_idx;
     u8 second_byte_bits = count - first_byte_bits;
 
-    retval = in[in_byte_idx] >> in_bit_idx;
-    in_byte_idx++; in_bit_idx = 0;
-    assert(in_byte_idx < 64);
+    retval = d->in[d->in_byte_idx] >> d->in_bit_idx;
+    d->in_byte_idx++; d->in_bit_idx = 0;
+    check(d, d->in_byte_idx < d->in_end);
+    if (d->error != NULL)
+      return 0;
 
-    retval += (in[in_byte_idx]  & ((1 << second_byte_bits) - 1))
+    retval += (d->in[d->in_byte_idx]  & ((1 << second_byte_bits) - 1))
                 << first_byte_bits;
-    in_bit_idx += second_byte_bits;
+    d->in_bit_idx += second_byte_bits;
   }
 
   return retval;
 }
 
-#if 0
-static void
-read_and_discard_zero_bits(u8 count)
-{
-  u8 bits;
-
-  while (count > 8) {
-    bits = read_bits(8);
-    assert(bits == 0);
-    count -= 8;
-  }
-
-  bits = read_bits(count);
-  assert(bits == 0);
-}
-#endif
-
 /* useful but opaquely named builtin: */
 #define num_trailing_zero_bits __builtin_ctz
 
-static u8 out[256];
-static u8 out_idx = 0;
-
 static void
-write_pixel(u8 r, u8 g, u8 b, u8 a)
+write_pixel(struct amd_decoder *d, u8 r, u8 g, u8 b, u8 a)
 {
-  assert(out_idx <= 63);
+  assert(d->out_idx <= 63);
 
-  out[out_idx*4]   = r;
-  out[out_idx*4+1] = g;
-  out[out_idx*4+2] = b;
-  out[out_idx*4+3] = a;
-  out_idx++;
+  d->out[d->out_idx*4]   = r;
+  d->out[d->out_idx*4+1] = g;
+  d->out[d->out_idx*4+2] = b;
+  d->out[d->out_idx*4+3] = a;
+  d->out_idx++;
 }
 
 static void
-write_g_cr_cb_pixel(u8 g, u8 cr, u8 cb, u8 a)
+write_g_cr_cb_pixel(struct amd_decoder *d, u8 g, u8 cr, u8 cb, u8 a)
 {
   u8 r = cr + g;
   u8 b = cb + g;
-  write_pixel(r, g, b, a);
+  write_pixel(d, r, g, b, a);
 }
 
 #define NUM_CACHELINES 4
@@ -95,14 +129,22 @@ write_g_cr_cb_pixel(u8 g, u8 cr, u8 cb, u8 a)
 #define CHAN_CB 2
 #define CHAN_A  3
 
+/*
+ * The first header gives each channel of each cacheline four bits --
+ * left/right header present, left/right constant -- which we pack
+ * into a case code indexing the table below.
+ */
+#define LHP(code)    (((code) >> 3) & 1)
+#define RHP(code)    (((code) >> 2) & 1)
+#define LCONST(code) (((code) >> 1) & 1)
+#define RCONST(code) ((code) & 1)
+
 struct color_channel_info {
-  u8 left_header_present;
-  u8 left_constant;
+  u8 code;
+
   u8 left_base;
   u8 left_bits;
 
-  u8 right_header_present;
-  u8 right_constant;
   u8 right_base;
   u8 right_bits;
 };
@@ -156,294 +198,1216 @@ struct color_channel_info {
  *
  **************************************************************************************/
 
-static void
-decode_amd(int dcc)
+/*
+ * Delta decoding, eight pixels at a time.
+ *
+ * A non-constant half-channel is stored as a byte of sign bits
+ * followed by one byte per bit-plane of the deltas, i.e. an 8xN bit
+ * matrix that has to be transposed.  Signs are applied and the deltas
+ * chained into pixel values with the eight pixels held as byte lanes
+ * of one 64-bit word.
+ */
+
+#define BYTE_LANES_LO7 UINT64_C(0x7f7f7f7f7f7f7f7f)
+#define BYTE_LANES_HI  UINT64_C(0x8080808080808080)
+#define BYTE_LANES_ONE UINT64_C(0x0101010101010101)
+
+static uint64_t
+broadcast_byte(u8 b)
 {
-  u8 cachelines_recovered;
+  return b * BYTE_LANES_ONE;
+}
 
-  switch (dcc) {
-  case 0x28:
-    cachelines_recovered = 4;
-    break;
-  case 0xcc:
-    cachelines_recovered = 3;
-    fprintf(stderr,
-            "Warning: Fourth cacheline not encoded in compressed payload.\n");
-    break;
-  case 0x66:
-    cachelines_recovered = 2;
-    fprintf(stderr,
-            "Warning: Third and fourth cachelines not encoded in compressed payload.\n");
-    break;
-  default:
-    fprintf(stderr, "DCC mode %x not (yet) supported.\n", dcc);
-    exit(EXIT_FAILURE);
+/* lane-wise addition mod 256 */
+static uint64_t
+add_byte_lanes(uint64_t a, uint64_t b)
+{
+  return ((a & BYTE_LANES_LO7) + (b & BYTE_LANES_LO7))
+         ^ ((a ^ b) & BYTE_LANES_HI);
+}
+
+/* 0xff in lane i if bit i of bits is set, 0x00 otherwise */
+static uint64_t
+expand_bits_to_lanes(u8 bits)
+{
+  uint64_t t = (bits * BYTE_LANES_ONE) & UINT64_C(0x8040201008040201);
+  t = ((t + BYTE_LANES_LO7) | t) & BYTE_LANES_HI;
+  return (t >> 7) * 0xff;
+}
+
+/* transpose the 8x8 bit matrix whose rows are the bytes of x */
+static uint64_t
+transpose_bits(uint64_t x)
+{
+#ifdef __SSE2__
+  /* bit 7 of each byte after shifting left by 7-p is bit p of that byte */
+  __m128i v = _mm_cvtsi64_si128(x);
+  uint64_t t = 0;
+  for (int p = 0; p < 8; p++)
+    t |= (uint64_t)(_mm_movemask_epi8(_mm_slli_epi64(v, 7 - p)) & 0xff)
+           << (8*p);
+  return t;
+#else
+  uint64_t t;
+  t = (x ^ (x >> 7))  & UINT64_C(0x00aa00aa00aa00aa); x ^= t ^ (t << 7);
+  t = (x ^ (x >> 14)) & UINT64_C(0x0000cccc0000cccc); x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & UINT64_C(0x00000000f0f0f0f0); x ^= t ^ (t << 28);
+  return x;
+#endif
+}
+
+/* read 8*nbytes (at most 64) bits, first bit read in the lsb */
+static uint64_t
+read_bytes_unaligned(struct amd_decoder *d, u8 nbytes)
+{
+  size_t byte = d->in_byte_idx;
+  u8 shift = d->in_bit_idx;
+  u8 raw[9] = { 0 };
+  uint64_t lo;
+
+  assert(nbytes >= 1 && nbytes <= 8);
+  check(d, byte * 8 + shift + nbytes * 8 <= d->in_end * 8);
+  if (d->error != NULL)
+    return 0;
+
+  memcpy(raw, d->in + byte, (byte + 9 <= d->in_end) ? 9 : d->in_end - byte);
+  memcpy(&lo, raw, 8);
+  lo = le64toh(lo);
+  if (shift != 0)
+    lo = (lo >> shift) | ((uint64_t)raw[8] << (64 - shift));
+  if (nbytes < 8)
+    lo &= (UINT64_C(1) << (8*nbytes)) - 1;
+
+  d->in_byte_idx += nbytes;
+  return lo;
+}
+
+/*
+ * Decode one half of a channel: 8 sign bits, then bits bit-planes.
+ * The top left pixel is base + 2*delta + sign if there is a header
+ * byte, and prev plus the sign-magnitude delta otherwise.
+ */
+static inline __attribute__((always_inline)) uint64_t
+decode_half(struct amd_decoder *d, u8 bits, u8 header_present,
+            u8 base, u8 prev)
+{
+  uint64_t raw = read_bytes_unaligned(d, bits + 1);
+  u8 signs = raw;
+  uint64_t magnitudes = transpose_bits(raw >> 8);
+
+  /* sign-magnitude: 255 - d is just d with every bit flipped */
+  uint64_t deltas = magnitudes ^ expand_bits_to_lanes(signs);
+
+  u8 first;
+  if (header_present)
+    first = base + ((u8)magnitudes << 1) + (signs & 1);
+  else
+    first = prev + (u8)deltas;
+  deltas = (deltas & ~UINT64_C(0xff)) | first;
+
+  /*
+   * The deltas chain as u0 -> u1 -> u2 -> u3 along the upper row,
+   * with l0 -> l1 hanging off u0 and l2 -> l3 off u2.  Reorder them
+   * as [u0 u1 u2 u3 | l0 l1 l2 l3], prefix-sum each run, then add
+   * u0 and u2 into the lower runs.
+   */
+  uint64_t v = (deltas & UINT64_C(0xffff00000000ffff))
+             | ((deltas >> 16) & UINT64_C(0x00000000ffff0000))
+             | ((deltas << 16) & UINT64_C(0x0000ffff00000000));
+  v = add_byte_lanes(v, (v << 8)  & UINT64_C(0xff00ff00ffffff00));
+  v = add_byte_lanes(v, (v << 16) & UINT64_C(0x00000000ffff0000));
+  v = add_byte_lanes(v, ((v & UINT64_C(0x0000000000ff00ff)) * 0x101) << 32);
+
+  return v;
+}
+
+/*
+ * Case handlers.  Each row of the great decoder table gets its own
+ * pair of functions, stamped out from the generic versions below with
+ * the case code as a compile-time constant so that the tests on it
+ * fold away; constant-constant cases reduce to fills.
+ */
+
+/* a second-header byte: either a constant, or a base with #tz delta bits */
+static inline __attribute__((always_inline)) void
+read_header_byte(struct amd_decoder *d, int constant, u8 *base, u8 *bits)
+{
+  u8 byte = read_bits(d, 8);
+
+  if (constant) {
+    *base = byte;
+    *bits = 0;
+  } else {
+    check(d, 0 != byte);
+    if (d->error != NULL) {
+      *base = 0;
+      *bits = 0;
+      return;
+    }
+    *base = byte & ~(1 << num_trailing_zero_bits(byte));
+    *bits = num_trailing_zero_bits(byte);
+  }
+}
+
+static inline __attribute__((always_inline)) void
+read_channel_header(struct amd_decoder *d, struct color_channel_info *ci,
+                    const int code)
+{
+  if (LHP(code)) {
+    read_header_byte(d, LCONST(code), &ci->left_base, &ci->left_bits);
+  } else {
+    ci->left_base = 0;
+    ci->left_bits = LCONST(code) ? 0 : 7;
   }
 
+  if (RHP(code)) {
+    read_header_byte(d, RCONST(code), &ci->right_base, &ci->right_bits);
+  } else if (RCONST(code)) {
+    ci->right_base = 0;
+    ci->right_bits = 0;
+  } else {
+    ci->right_base = ci->left_base;
+    ci->right_bits = ci->left_bits;
+  }
+}
+
+static inline __attribute__((always_inline)) void
+decode_channel_pixels(struct amd_decoder *d,
+                      const struct color_channel_info *ci,
+                      uint64_t *left, uint64_t *right, const int code)
+{
+  /* with no left header byte, top left pixel _is_ sign-and-magnitude
+     encoded.  why? to mess with my head, that's why. */
+  if (LCONST(code))
+    *left = broadcast_byte(ci->left_base);
+  else
+    *left = decode_half(d, ci->left_bits, LHP(code), ci->left_base, 0);
+
+  /* without a right header byte, the right half starts from (or, if
+     constant, inherits) the left half's upper right pixel */
+  u8 left_upper_right = *left >> 24;
+  if (RCONST(code))
+    *right = broadcast_byte(RHP(code) ? ci->right_base : left_upper_right);
+  else
+    *right = decode_half(d, ci->right_bits, RHP(code), ci->right_base,
+                         left_upper_right);
+}
+
+#define DECODER_CASE(code)                                              \
+  static void                                                           \
+  read_header_##code(struct amd_decoder *d,                             \
+                     struct color_channel_info *ci)                     \
+  {                                                                     \
+    read_channel_header(d, ci, code);                                   \
+  }                                                                     \
+  static void                                                           \
+  decode_pixels_##code(struct amd_decoder *d,                           \
+                       const struct color_channel_info *ci,             \
+                       uint64_t *left, uint64_t *right)                 \
+  {                                                                     \
+    decode_channel_pixels(d, ci, left, right, code);                    \
+  }
+
+DECODER_CASE(0x1)
+DECODER_CASE(0x3)
+DECODER_CASE(0x4)
+DECODER_CASE(0x5)
+DECODER_CASE(0x8)
+DECODER_CASE(0x9)
+DECODER_CASE(0xb)
+DECODER_CASE(0xc)
+DECODER_CASE(0xd)
+DECODER_CASE(0xe)
+DECODER_CASE(0xf)
+
+struct decoder_case {
+  void (*read_header)(struct amd_decoder *, struct color_channel_info *);
+  void (*decode_pixels)(struct amd_decoder *,
+                        const struct color_channel_info *,
+                        uint64_t *, uint64_t *);
+};
+
+#define KNOWN_CASE(code) [code] = { read_header_##code, decode_pixels_##code }
+
+/* cases marked unknown in the table above are left NULL */
+static const struct decoder_case great_decoder_table[16] = {
+  KNOWN_CASE(0x1),
+  KNOWN_CASE(0x3),
+  KNOWN_CASE(0x4),              /* conjectured */
+  KNOWN_CASE(0x5),
+  KNOWN_CASE(0x8),
+  KNOWN_CASE(0x9),
+  KNOWN_CASE(0xb),
+  KNOWN_CASE(0xc),
+  KNOWN_CASE(0xd),
+  KNOWN_CASE(0xe),
+  KNOWN_CASE(0xf),
+};
+
+/* the compressed cacheline: two headers, then the pixel data */
+static void
+decode_compressed(struct amd_decoder *d, u8 cachelines_recovered)
+{
   struct color_channel_info chan_info[NUM_CACHELINES][NUM_CHANNELS];
   u8 cl, chan;
 
   /* first header: 2 bytes per cacheline */
   for (cl = 0; cl < cachelines_recovered; cl++) {
-    for (chan = 0; chan < NUM_CHANNELS; chan ++) {
-      chan_info[cl][chan].left_header_present = read_bits(1);
-      chan_info[cl][chan].right_header_present = read_bits(1);
-    }
+    u8 header_present = read_bits(d, 8);
+    u8 constant = read_bits(d, 8);
 
     for (chan = 0; chan < NUM_CHANNELS; chan ++) {
-      chan_info[cl][chan].left_constant = read_bits(1);
-      chan_info[cl][chan].right_constant = read_bits(1);
+      u8 code = ((header_present >> (2*chan)) & 3) << 2
+              | ((constant >> (2*chan)) & 3);
+      /* the bits come lsb first, left before right */
+      code = ((code & 0x5) << 1) | ((code & 0xa) >> 1);
+      chan_info[cl][chan].code = code;
+      check(d, great_decoder_table[code].read_header != NULL);
     }
   }
+  if (d->error != NULL)
+    return;
+
+  /* second header: number of bytes depends on first header */
+  for (cl = 0; cl < cachelines_recovered; cl++)
+    for (chan = 0; chan < NUM_CHANNELS; chan ++)
+      great_decoder_table[chan_info[cl][chan].code]
+        .read_header(d, &chan_info[cl][chan]);
+  if (d->error != NULL)
+    return;
+
+  /*
+   * Each half of a channel is kept as eight byte lanes of a 64-bit
+   * word, in output order: the upper four pixels, then the lower four.
+   */
+  uint64_t left[NUM_CHANNELS];
+  uint64_t right[NUM_CHANNELS];
+  u8 p;
 
-  /* consistency check on first header */
   for (cl = 0; cl < cachelines_recovered; cl++) {
-    for (chan = 0; chan < NUM_CHANNELS; chan ++) {
-      if (chan_info[cl][chan].left_header_present) {
-        if (chan_info[cl][chan].right_header_present) {
-          /* all cases handled */
-        } else {                /* !rhp */
-          /* note: case where left is constant but right is not is not handled. */
-          assert(!chan_info[cl][chan].left_constant || chan_info[cl][chan].right_constant);
-        }
-      } else {                  /* !lhp */
-        if (chan_info[cl][chan].right_header_present) {
-          /* note: have only seen 01; have good guess for 00; other cases unhandled */
-          assert(!chan_info[cl][chan].left_constant);
-        } else {                /* !rhp */
-          /* note: have only seen 11 and 01, other cases not handled. */
-          assert(chan_info[cl][chan].right_constant);
-        }
-      }
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+      great_decoder_table[chan_info[cl][chan].code]
+        .decode_pixels(d, &chan_info[cl][chan], &left[chan], &right[chan]);
+
+    /* first and second quadrants, then third and fourth */
+    for (p = 0; p < 8; p++) {
+      write_g_cr_cb_pixel(d, left[CHAN_G] >> (8*p),  left[CHAN_CR] >> (8*p),
+                          left[CHAN_CB] >> (8*p), left[CHAN_A] >> (8*p));
+    }
+    for (p = 0; p < 8; p++) {
+      write_g_cr_cb_pixel(d, right[CHAN_G] >> (8*p),  right[CHAN_CR] >> (8*p),
+                          right[CHAN_CB] >> (8*p), right[CHAN_A] >> (8*p));
     }
   }
+}
 
-  /* second header: number of bytes depends on first header */
-  for (cl = 0; cl < cachelines_recovered; cl++) {
-    for (chan = 0; chan < NUM_CHANNELS; chan ++) {
+/*
+ * How each DCC value lays out the payload of a block: a first input
+ * cacheline packing `compressed` output cachelines, then `raw` output
+ * cachelines stored as they are, one per input cacheline.  That the
+ * cachelines 0xcc and 0x66 leave out follow uncompressed is our
+ * conjecture, which matches the 2:1 and 4:3 ratios these values are
+ * known for.  The clear values (as named in Mesa) have no payload at
+ * all; the register clear value 0x20 is not supported, since the clear
+ * color register is not part of a dump.
+ */
+struct dcc_layout {
+  u8 known;
+  u8 compressed;
+  u8 raw;
+  u8 clear;
+  u8 clear_pixel[4];
+};
+
+static const struct dcc_layout dcc_layouts[256] = {
+  [0x00] = { .known = 1, .clear = 1, .clear_pixel = { 0x00, 0x00, 0x00, 0x00 } },
+  [0x40] = { .known = 1, .clear = 1, .clear_pixel = { 0x00, 0x00, 0x00, 0xff } },
+  [0x80] = { .known = 1, .clear = 1, .clear_pixel = { 0xff, 0xff, 0xff, 0x00 } },
+  [0xc0] = { .known = 1, .clear = 1, .clear_pixel = { 0xff, 0xff, 0xff, 0xff } },
+  [0x28] = { .known = 1, .compressed = 4 },
+  [0xcc] = { .known = 1, .compressed = 3, .raw = 1 },
+  [0x66] = { .known = 1, .compressed = 2, .raw = 2 },
+  [0xff] = { .known = 1, .raw = 4 },
+};
+
+/* bytes of payload a DCC value takes */
+static u16
+dcc_payload_bytes(int dcc)
+{
+  const struct dcc_layout *layout = &dcc_layouts[dcc];
+  return ((layout->compressed != 0) + layout->raw) * CACHELINE_BYTES;
+}
+
+/*
+ * Decode a block with one reader running through the whole payload:
+ * the compressed cacheline, then any raw ones.
+ */
+static void
+decode_amd(struct amd_decoder *d, int dcc)
+{
+  const struct dcc_layout *layout = &dcc_layouts[dcc];
+  u8 cachelines_recovered = layout->compressed;
+
+  check(d, layout->known);
+  check(d, d->in_len >= dcc_payload_bytes(dcc));
+  if (d->error != NULL)
+    return;
+
+  if (layout->clear) {
+    for (u8 p = 0; p < OUT_BYTES / 4; p++)
+      write_pixel(d, layout->clear_pixel[0], layout->clear_pixel[1],
+                  layout->clear_pixel[2], layout->clear_pixel[3]);
+    return;
+  }
+
+  if (cachelines_recovered != 0) {
+    d->in_end = CACHELINE_BYTES;
+    decode_compressed(d, cachelines_recovered);
+    d->in_end = d->in_len;
+    if (d->error != NULL)
+      return;
+
+    /* the rest of the compressed cacheline is padding */
+    d->in_byte_idx = CACHELINE_BYTES;
+    d->in_bit_idx = 0;
+  }
+
+  for (u8 cl = 0; cl < layout->raw; cl++) {
+    memcpy(d->out + d->out_idx * 4, d->in + d->in_byte_idx, CACHELINE_BYTES);
+    d->out_idx += CACHELINE_BYTES / 4;
+    d->in_byte_idx += CACHELINE_BYTES;
+  }
+}
+
+/*
+ * Encoder: the forward model of the above.  A 256-byte block of RGBA
+ * pixels, laid out as decode_amd writes them, is converted to G/Cr/Cb,
+ * each channel half of each cacheline gets the cheapest row of the
+ * great decoder table that can represent it, and as many cachelines as
+ * fit are packed into the first 64 bytes of the payload, 4, 3 or 2 at
+ * a time (DCC 0x28, 0xcc or 0x66), or the block is left uncompressed
+ * (0xff).
+ *
+ * The conjectured case 0100 is never chosen.
+ */
+
+#define DCC_UNCOMPRESSED 0xff
+#define NO_PLAN          0xff
+
+struct amd_encoder {
+  u8 *out;
+  size_t out_bit_idx;
+};
+
+static void
+write_bits(struct amd_encoder *e, u8 val, u8 count)
+{
+  assert(count <= 8);
+  assert(e->out_bit_idx + count <= CACHELINE_BYTES * 8);
+
+  for (u8 b = 0; b < count; b++, e->out_bit_idx++) {
+    if (val & (1 << b))
+      e->out[e->out_bit_idx / 8] |= 1 << (e->out_bit_idx % 8);
+  }
+}
+
+/* delta p rebuilds lane delta_lane[p] from lane delta_pred_lane[p] */
+static const u8 delta_lane[8]      = { 0, 1, 4, 5, 2, 3, 6, 7 };
+static const u8 delta_pred_lane[8] = { 0, 0, 0, 4, 1, 2, 2, 6 };
+
+/* magnitude bits needed to store delta in sign-magnitude form */
+static u8
+delta_bits(u8 delta)
+{
+  u8 magnitude = (delta & 0x80) ? (u8)~delta : delta;
+  return magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+}
+
+static u8
+half_delta_bits(const u8 half[8])
+{
+  u8 bits = 0;
+  for (u8 p = 1; p < 8; p++) {
+    u8 b = delta_bits(half[delta_lane[p]] - half[delta_pred_lane[p]]);
+    if (b > bits)
+      bits = b;
+  }
+  return bits;
+}
+
+static int
+half_is_constant(const u8 half[8])
+{
+  for (u8 p = 1; p < 8; p++)
+    if (half[p] != half[0])
+      return 0;
+  return 1;
+}
+
+/*
+ * Pick the cheapest case for one channel of one cacheline, fill in
+ * ci the way the decoder's header handler would, and return the
+ * number of bits the channel takes beyond the first header.
+ */
+static int
+plan_channel(const u8 left[8], const u8 right[8],
+             struct color_channel_info *ci)
+{
+  int left_constant = half_is_constant(left);
+  int right_constant = half_is_constant(right);
+  int right_inherits = right_constant && right[0] == left[3];
+  u8 left_bits = half_delta_bits(left);
+  u8 right_bits = half_delta_bits(right);
+  u8 shared_bits = delta_bits(right[0] - left[3]);
+  if (shared_bits < right_bits)
+    shared_bits = right_bits;
+  if (shared_bits < left_bits)
+    shared_bits = left_bits;
+
+  int cost[16];
+  for (u8 code = 0; code < 16; code++)
+    cost[code] = -1;
+
+  if (left_constant && left[0] == 0 && right_inherits)
+    cost[0x3] = 0;
+  if (left_constant && right_inherits)
+    cost[0xb] = 8;
+  if (left_constant && right_constant)
+    cost[0xf] = 8 + 8;
+  if (left_constant)
+    cost[0xe] = 8 + 16 + 8*right_bits;
+  if (right_inherits) {
+    cost[0x9] = 16 + 8*left_bits;
+    cost[0x1] = 8 + 8*7;
+  }
+  if (right_constant) {
+    cost[0xd] = 16 + 8*left_bits + 8;
+    cost[0x5] = 8 + 8*7 + 8;
+  }
+  cost[0xc] = 16 + 8*left_bits + 16 + 8*right_bits;
+  cost[0x8] = 16 + 8*shared_bits + 8 + 8*shared_bits;
 
-      if (chan_info[cl][chan].left_header_present) {
-        u8 left_byte = read_bits(8);
-        if (chan_info[cl][chan].left_constant) {
-          chan_info[cl][chan].left_base  = left_byte;
-          chan_info[cl][chan].left_bits  = 0;
-        } else {
-          assert (0 != left_byte);
-          chan_info[cl][chan].left_base
-            = left_byte & ~(1 << num_trailing_zero_bits(left_byte));
-          chan_info[cl][chan].left_bits = num_trailing_zero_bits(left_byte);
-        }
-      } else {
-        if (chan_info[cl][chan].left_constant) {
-          chan_info[cl][chan].left_base = 0;
-          chan_info[cl][chan].left_bits = 0;
-        } else {
-          chan_info[cl][chan].left_base = 0;
-          chan_info[cl][chan].left_bits = 7;
-        }
-      }
-
-      if (chan_info[cl][chan].right_header_present) {
-        u8 right_byte = read_bits(8);
-        if (chan_info[cl][chan].right_constant) {
-          chan_info[cl][chan].right_base  = right_byte;
-          chan_info[cl][chan].right_bits  = 0;
-        } else {
-          assert (0 != right_byte);
-          chan_info[cl][chan].right_base
-            = right_byte & ~(1 << num_trailing_zero_bits(right_byte));
-          chan_info[cl][chan].right_bits = num_trailing_zero_bits(right_byte);
-        }
-      } else {
-        if (chan_info[cl][chan].right_constant) {
-          chan_info[cl][chan].right_base = 0;
-          chan_info[cl][chan].right_bits = 0;
-        } else {
-          chan_info[cl][chan].right_base = chan_info[cl][chan].left_base;
-          chan_info[cl][chan].right_bits = chan_info[cl][chan].left_bits;
-        }
-      }
+  u8 best = NO_PLAN;
+  for (u8 code = 0; code < 16; code++)
+    if (cost[code] >= 0 && (best == NO_PLAN || cost[code] < cost[best]))
+      best = code;
+  assert(best != NO_PLAN && great_decoder_table[best].read_header != NULL);
+
+  ci->code = best;
+  ci->left_bits = LCONST(best) ? 0 : LHP(best) ? left_bits : 7;
+  if (best == 0x8)
+    ci->left_bits = shared_bits;
+  if (LCONST(best))
+    ci->left_base = left[0];
+  else if (LHP(best))
+    ci->left_base = left[0] & ~((2 << ci->left_bits) - 1);
+  else
+    ci->left_base = 0;
+
+  if (RHP(best)) {
+    ci->right_bits = RCONST(best) ? 0 : right_bits;
+    ci->right_base = RCONST(best)
+                   ? right[0] : right[0] & ~((2 << ci->right_bits) - 1);
+  } else if (RCONST(best)) {
+    ci->right_base = 0;
+    ci->right_bits = 0;
+  } else {
+    ci->right_base = ci->left_base;
+    ci->right_bits = ci->left_bits;
+  }
+
+  return cost[best];
+}
+
+/* inverse of decode_half */
+static void
+encode_half(struct amd_encoder *e, const u8 half[8], u8 bits,
+            u8 header_present, u8 base, u8 prev)
+{
+  u8 signs = 0;
+  u8 magnitudes[8];
+
+  for (u8 p = 0; p < 8; p++) {
+    u8 delta;
+    if (p == 0 && header_present) {
+      /* top left pixel is base + 2*magnitude + sign */
+      delta = half[0] - base;
+      signs |= (delta & 1);
+      magnitudes[0] = delta >> 1;
+      continue;
+    }
+    if (p == 0)
+      delta = half[0] - prev;
+    else
+      delta = half[delta_lane[p]] - half[delta_pred_lane[p]];
+    if (delta & 0x80) {
+      signs |= 1 << p;
+      delta = ~delta;
     }
+    magnitudes[p] = delta;
   }
 
-  u8 upper_pixels[8][NUM_CHANNELS];
-  u8 lower_pixels[8][NUM_CHANNELS];
-  u8 p;
+  write_bits(e, signs, 8);
+  for (u8 b = 0; b < bits; b++) {
+    u8 plane = 0;
+    for (u8 p = 0; p < 8; p++)
+      plane |= ((magnitudes[p] >> b) & 1) << p;
+    write_bits(e, plane, 8);
+  }
+}
 
-  for (cl = 0; cl < cachelines_recovered; cl++) {
+struct block_plan {
+  struct color_channel_info chan_info[NUM_CACHELINES][NUM_CHANNELS];
+  u8 halves[NUM_CACHELINES][NUM_CHANNELS][2][8];
+  int cacheline_bits[NUM_CACHELINES];
+};
+
+static void
+plan_block(const u8 block[OUT_BYTES], struct block_plan *plan)
+{
+  for (u8 cl = 0; cl < NUM_CACHELINES; cl++) {
+    for (u8 px = 0; px < 16; px++) {
+      const u8 *rgba = block + cl*64 + px*4;
+      u8 half = px / 8, lane = px % 8;
+
+      /* inverse of write_g_cr_cb_pixel */
+      plan->halves[cl][CHAN_G][half][lane]  = rgba[1];
+      plan->halves[cl][CHAN_CR][half][lane] = rgba[0] - rgba[1];
+      plan->halves[cl][CHAN_CB][half][lane] = rgba[2] - rgba[1];
+      plan->halves[cl][CHAN_A][half][lane]  = rgba[3];
+    }
+
+    plan->cacheline_bits[cl] = 16;          /* first header */
+    for (u8 chan = 0; chan < NUM_CHANNELS; chan++)
+      plan->cacheline_bits[cl]
+        += plan_channel(plan->halves[cl][chan][0], plan->halves[cl][chan][1],
+                        &plan->chan_info[cl][chan]);
+  }
+}
+
+/*
+ * DCC value that packs the most cachelines of the plan into 64 bytes.
+ * The cachelines that do not fit follow uncompressed (see dcc_layouts),
+ * so the sizes match the 4:1, 2:1, and 4:3 ratios of 0x28, 0xcc, and
+ * 0x66.
+ */
+static u8
+plan_dcc(const struct block_plan *plan, int *payload_bits)
+{
+  static const u8 dcc_by_cachelines[NUM_CACHELINES + 1]
+    = { DCC_UNCOMPRESSED, DCC_UNCOMPRESSED, 0x66, 0xcc, 0x28 };
+  int bits = 0;
+  u8 fit = 0;
+
+  for (u8 cl = 0; cl < NUM_CACHELINES; cl++) {
+    if (bits + plan->cacheline_bits[cl] > CACHELINE_BYTES * 8)
+      break;
+    bits += plan->cacheline_bits[cl];
+    fit++;
+  }
+
+  if (fit < 2) {
+    *payload_bits = OUT_BYTES * 8;
+    return DCC_UNCOMPRESSED;
+  }
+  *payload_bits = bits + (NUM_CACHELINES - fit) * CACHELINE_BYTES * 8;
+  return dcc_by_cachelines[fit];
+}
+
+/*
+ * Encode a block into payload and return its DCC value; the payload
+ * takes dcc_payload_bytes(dcc) bytes, laid out as in dcc_layouts.
+ */
+static u8
+encode_amd(const u8 block[OUT_BYTES], u8 payload[IN_BYTES], int *payload_bits)
+{
+  struct block_plan plan;
+  plan_block(block, &plan);
+  u8 dcc = plan_dcc(&plan, payload_bits);
+
+  memset(payload, 0, IN_BYTES);
+  if (dcc == DCC_UNCOMPRESSED) {
+    memcpy(payload, block, OUT_BYTES);
+    return dcc;
+  }
+
+  struct amd_encoder e = { payload, 0 };
+  u8 cachelines = dcc_layouts[dcc].compressed;
+  u8 cl, chan;
+
+  for (cl = 0; cl < cachelines; cl++) {
+    u8 header_present = 0, constant = 0;
     for (chan = 0; chan < NUM_CHANNELS; chan++) {
-      u8 signs[8];
-      u8 deltas[8];
-      u8 b;
-
-      /*
-       * left side
-       */
-      if (chan_info[cl][chan].left_constant) {
-        for (p = 0; p < 4; p++) {
-          upper_pixels[p][chan] = chan_info[cl][chan].left_base;
-          lower_pixels[p][chan] = chan_info[cl][chan].left_base;
-        }
-      } else {
-        for (p = 0; p < 8; p++)
-          signs[p] = read_bits(1);
-        for (p = 0; p < 8; p++)
-          deltas[p] = 0;
-        for (b = 0; b < chan_info[cl][chan].left_bits; b++)
-          for (p = 0; p < 8; p++)
-            deltas[p] |= read_bits(1) << b;
-
-        if (chan_info[cl][chan].left_header_present) {
-          /* normally, top left pixel is not delta encoded, sign is lsb */
-          upper_pixels[0][chan] = chan_info[cl][chan].left_base + (deltas[0] << 1) + signs[0];
-        } else {
-          /* with no left header byte, top left pixel _is_
-             sign-and-magnitude encoded.  why? to mess with my head,
-             that's why. */
-          upper_pixels[0][chan] = (signs[0] ? 255 - deltas[0] : deltas[0]);
-        }
-        upper_pixels[1][chan] = upper_pixels[0][chan]  + (signs[1] ? 255 - deltas[1] : deltas[1]);
-
-        lower_pixels[0][chan] = upper_pixels[0][chan]  + (signs[2] ? 255 - deltas[2] : deltas[2]);
-        lower_pixels[1][chan] = lower_pixels[0][chan]  + (signs[3] ? 255 - deltas[3] : deltas[3]);
-
-        upper_pixels[2][chan] = upper_pixels[1][chan]  + (signs[4] ? 255 - deltas[4] : deltas[4]);
-        upper_pixels[3][chan] = upper_pixels[2][chan]  + (signs[5] ? 255 - deltas[5] : deltas[5]);
-
-        lower_pixels[2][chan] = upper_pixels[2][chan]  + (signs[6] ? 255 - deltas[6] : deltas[6]);
-        lower_pixels[3][chan] = lower_pixels[2][chan]  + (signs[7] ? 255 - deltas[7] : deltas[7]);
-      }
-
-      /*
-       * right side
-       */
-      if (chan_info[cl][chan].right_constant) {
-        if (chan_info[cl][chan].right_header_present) {
-          for (p = 4; p < 8; p++) {
-            upper_pixels[p][chan] = chan_info[cl][chan].right_base;
-            lower_pixels[p][chan] = chan_info[cl][chan].right_base;
-          }
-        } else {
-          /* Inherit from left half upper right pixel.  Note that if
-             the left side is itself constant then this pixel's value
-             is equal to left_base */
-          for (p = 4; p < 8; p++) {
-            upper_pixels[p][chan] = upper_pixels[3][chan];
-            lower_pixels[p][chan] = upper_pixels[3][chan];
-          }
-        }
-      } else {
-        for (p = 0; p < 8; p++)
-          signs[p] = read_bits(1);
-        for (p = 0; p < 8; p++)
-          deltas[p] = 0;
-        for (b = 0; b < chan_info[cl][chan].right_bits; b++)
-          for (p = 0; p < 8; p++)
-            deltas[p] |= read_bits(1) << b;
-
-        if (chan_info[cl][chan].right_header_present) {
-          /* second half top left pixel is not delta encoded, sign is lsb */
-          upper_pixels[4][chan] = chan_info[cl][chan].right_base + (deltas[0] << 1) + signs[0];
-        } else {
-          upper_pixels[4][chan] = upper_pixels[3][chan] + (signs[0] ? 255 - deltas[0] : deltas[0]);
-        }
-        upper_pixels[5][chan] = upper_pixels[4][chan]  + (signs[1] ? 255 - deltas[1] : deltas[1]);
-
-        lower_pixels[4][chan] = upper_pixels[4][chan]  + (signs[2] ? 255 - deltas[2] : deltas[2]);
-        lower_pixels[5][chan] = lower_pixels[4][chan]  + (signs[3] ? 255 - deltas[3] : deltas[3]);
-
-        upper_pixels[6][chan] = upper_pixels[5][chan]  + (signs[4] ? 255 - deltas[4] : deltas[4]);
-        upper_pixels[7][chan] = upper_pixels[6][chan]  + (signs[5] ? 255 - deltas[5] : deltas[5]);
-
-        lower_pixels[6][chan] = upper_pixels[6][chan]  + (signs[6] ? 255 - deltas[6] : deltas[6]);
-        lower_pixels[7][chan] = lower_pixels[6][chan]  + (signs[7] ? 255 - deltas[7] : deltas[7]);
-      }
+      u8 code = plan.chan_info[cl][chan].code;
+      header_present |= (LHP(code) | RHP(code) << 1) << (2*chan);
+      constant |= (LCONST(code) | RCONST(code) << 1) << (2*chan);
     }
+    write_bits(&e, header_present, 8);
+    write_bits(&e, constant, 8);
+  }
 
-    /* first quadrant */
-    for (p = 0; p < 4; p++) {
-      write_g_cr_cb_pixel(upper_pixels[p][CHAN_G],  upper_pixels[p][CHAN_CR],
-                          upper_pixels[p][CHAN_CB], upper_pixels[p][CHAN_A]);
+  for (cl = 0; cl < cachelines; cl++) {
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+      const struct color_channel_info *ci = &plan.chan_info[cl][chan];
+      if (LHP(ci->code))
+        write_bits(&e, LCONST(ci->code)
+                       ? ci->left_base : ci->left_base | (1 << ci->left_bits), 8);
+      if (RHP(ci->code))
+        write_bits(&e, RCONST(ci->code)
+                       ? ci->right_base : ci->right_base | (1 << ci->right_bits), 8);
     }
-    /* second quadrant */
-    for (p = 0; p < 4; p++) {
-      write_g_cr_cb_pixel(lower_pixels[p][CHAN_G],  lower_pixels[p][CHAN_CR],
-                          lower_pixels[p][CHAN_CB], lower_pixels[p][CHAN_A]);
+  }
+
+  for (cl = 0; cl < cachelines; cl++) {
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+      const struct color_channel_info *ci = &plan.chan_info[cl][chan];
+      const u8 *left = plan.halves[cl][chan][0];
+      const u8 *right = plan.halves[cl][chan][1];
+
+      if (!LCONST(ci->code))
+        encode_half(&e, left, ci->left_bits, LHP(ci->code), ci->left_base, 0);
+      if (!RCONST(ci->code))
+        encode_half(&e, right, ci->right_bits, RHP(ci->code), ci->right_base,
+                    left[3]);
     }
-    /* third quadrant */
-    for (p = 4; p < 8; p++) {
-      write_g_cr_cb_pixel(upper_pixels[p][CHAN_G],  upper_pixels[p][CHAN_CR],
-                          upper_pixels[p][CHAN_CB], upper_pixels[p][CHAN_A]);
+  }
+
+  memcpy(payload + CACHELINE_BYTES, block + cachelines * CACHELINE_BYTES,
+         (NUM_CACHELINES - cachelines) * CACHELINE_BYTES);
+
+  assert(e.out_bit_idx + (NUM_CACHELINES - cachelines) * CACHELINE_BYTES * 8
+         == *payload_bits);
+  return dcc;
+}
+
+/* size-only: the DCC value a block would get, without emitting it */
+static u8
+encoded_dcc(const u8 block[OUT_BYTES], int *payload_bits)
+{
+  struct block_plan plan;
+  plan_block(block, &plan);
+  return plan_dcc(&plan, payload_bits);
+}
+
+/*
+ * Surface mode: decode every 256-byte block of an AMD surface dump
+ * according to its DCC metadata byte, splitting the blocks across
+ * threads and writing into a memory-mapped output file.  With -e, run
+ * the encoder's size model over every block instead, writing out the
+ * DCC byte each block would get.
+ */
+
+#define BLOCK_BYTES      256
+
+struct surface_job {
+  pthread_t thread;
+  const u8 *surface;
+  const u8 *dcc;
+  u8 *output;
+  size_t first_block;
+  size_t end_block;
+
+  size_t histogram[256];
+  size_t unsupported;
+  size_t malformed;
+  size_t payload_bits;
+};
+
+static void *
+decode_surface_blocks(void *arg)
+{
+  struct surface_job *job = arg;
+  struct amd_decoder d;
+
+  for (size_t blk = job->first_block; blk < job->end_block; blk++) {
+    const u8 *src = job->surface + blk * BLOCK_BYTES;
+    u8 *dst = job->output + blk * BLOCK_BYTES;
+    u8 dcc = job->dcc[blk];
+
+    job->histogram[dcc]++;
+
+    if (!dcc_layouts[dcc].known) {
+      memset(dst, 0, BLOCK_BYTES);
+      job->unsupported++;
+      continue;
     }
-    /* fourth quadrant */
-    for (p = 4; p < 8; p++) {
-      write_g_cr_cb_pixel(lower_pixels[p][CHAN_G],  lower_pixels[p][CHAN_CR],
-                          lower_pixels[p][CHAN_CB], lower_pixels[p][CHAN_A]);
+
+    /* a block's payload starts at the beginning of its own 256 bytes */
+    init_decoder(&d, src, BLOCK_BYTES, dst);
+    decode_amd(&d, dcc);
+    if (d.error != NULL) {
+      memset(dst, 0, BLOCK_BYTES);
+      job->malformed++;
     }
   }
+
+  return NULL;
+}
+
+static const u8 *
+map_input(const char *name, size_t *len)
+{
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    perror(name);
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  int rv = fstat(fd, &st);
+  assert(rv == 0);
+  *len = st.st_size;
+  if (*len == 0) {
+    fprintf(stderr, "%s: empty file.\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  const u8 *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(data != MAP_FAILED);
+  close(fd);
+  return data;
+}
+
+static void *
+encode_surface_blocks(void *arg)
+{
+  struct surface_job *job = arg;
+  int payload_bits;
+
+  for (size_t blk = job->first_block; blk < job->end_block; blk++) {
+    u8 dcc = encoded_dcc(job->surface + blk * BLOCK_BYTES, &payload_bits);
+    job->output[blk] = dcc;
+    job->histogram[dcc]++;
+    job->payload_bits += payload_bits;
+  }
+
+  return NULL;
+}
+
+static u8 *
+map_output(const char *name, size_t len)
+{
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror(name);
+    exit(EXIT_FAILURE);
+  }
+  int rv = ftruncate(fd, len);
+  assert(rv == 0);
+  u8 *data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(data != MAP_FAILED);
+  close(fd);
+  return data;
 }
 
 static void
-usage(void)
+unmap_output(u8 *data, size_t len)
 {
-  printf("Usage: decode-amd [-t] -d [28|66|cc]\n");
-  exit(EXIT_FAILURE);
+  int rv = msync(data, len, MS_SYNC);
+  assert(rv == 0);
+  munmap(data, len);
 }
 
+/* split nblocks across nthreads copies of proto, run them, and sum up */
 static void
-read_text(void)
+run_surface_jobs(const struct surface_job *proto, size_t nblocks,
+                 int nthreads, void *(*worker)(void *),
+                 struct surface_job *total)
 {
   int rv;
-  for (u8 i = 0; i < 64; i++) {
-    rv = scanf(" %hhx", &in[i]);
-    assert(rv == 1);
+
+  if (nthreads > nblocks)
+    nthreads = nblocks;
+  struct surface_job *jobs = calloc(nthreads, sizeof(*jobs));
+  assert(jobs != NULL);
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t] = *proto;
+    jobs[t].first_block = nblocks * t / nthreads;
+    jobs[t].end_block = nblocks * (t+1) / nthreads;
+    rv = pthread_create(&jobs[t].thread, NULL, worker, &jobs[t]);
+    assert(rv == 0);
   }
+
+  memset(total, 0, sizeof(*total));
+  for (int t = 0; t < nthreads; t++) {
+    rv = pthread_join(jobs[t].thread, NULL);
+    assert(rv == 0);
+    for (int v = 0; v < 256; v++)
+      total->histogram[v] += jobs[t].histogram[v];
+    total->unsupported += jobs[t].unsupported;
+    total->malformed += jobs[t].malformed;
+    total->payload_bits += jobs[t].payload_bits;
+  }
+  free(jobs);
 }
 
 static void
-read_raw()
+print_histogram(const struct surface_job *total, size_t nblocks)
 {
-  size_t nb = fread(in, 1, 64, stdin);
-  assert(nb == 64);
+  printf("DCC histogram (%zu blocks):\n", nblocks);
+  for (int v = 0; v < 256; v++)
+    if (total->histogram[v] != 0)
+      printf("  %02x: %zu\n", v, total->histogram[v]);
+}
+
+/*
+ * Linear mode: map a decoded surface back to image coordinates.  In
+ * every swizzle mode, the byte address of a 32-bit pixel is its x and
+ * y coordinate bits interleaved in a fixed pattern within a swizzle
+ * block, with the blocks themselves laid out row-major.  The first six
+ * bits (X0 X1 Y0 X2 Y1 Y2) are the 8x8 pixel layout of a DCC block, as
+ * seen in the Skew example; the larger standard modes continue with
+ * alternating X and Y bits.  The XOR (_X) variants, which also hash in
+ * pipe and bank bits, are not supported.
+ *
+ * Since x and y bits never share an address bit, the address of a
+ * pixel is the sum of a column and a row offset, each looked up in a
+ * table computed once per surface.
+ */
+
+struct swizzle_mode {
+  const char *name;
+  const char *bits;   /* coordinate of each pixel address bit, LSB first */
+};
+
+static const struct swizzle_mode swizzle_modes[] = {
+  { "256B", "xxyxyy" },
+  { "4K",   "xxyxyyxyxy" },
+  { "64K",  "xxyxyyxyxyxyxy" },
+};
+
+#define NUM_SWIZZLE_MODES (sizeof(swizzle_modes) / sizeof(swizzle_modes[0]))
+
+struct linear_layout {
+  u32 width;
+  u32 height;
+  size_t *column_offset;
+  size_t *row_offset;
+  size_t surface_bytes;
+};
+
+static const struct swizzle_mode *
+find_swizzle_mode(const char *name)
+{
+  for (int m = 0; m < NUM_SWIZZLE_MODES; m++)
+    if (strcasecmp(name, swizzle_modes[m].name) == 0)
+      return &swizzle_modes[m];
+  return NULL;
+}
+
+/* scatter the low bits of coord into the pattern positions holding axis */
+static size_t
+deposit_coord(const char *bits, char axis, u32 coord)
+{
+  size_t offset = 0;
+  for (int b = 0; bits[b] != '\0'; b++) {
+    if (bits[b] != axis)
+      continue;
+    offset |= (size_t)(coord & 1) << (b + 2);
+    coord >>= 1;
+  }
+  return offset;
 }
 
 static void
-write_text(void)
+init_layout(struct linear_layout *layout, const struct swizzle_mode *mode,
+            u32 width, u32 height)
+{
+  int xbits = 0, ybits = 0;
+  for (int b = 0; mode->bits[b] != '\0'; b++) {
+    if (mode->bits[b] == 'x')
+      xbits++;
+    else
+      ybits++;
+  }
+
+  size_t block_bytes = (size_t)4 << (xbits + ybits);
+  u32 block_width = 1 << xbits, block_height = 1 << ybits;
+  size_t pitch_blocks = (width + block_width - 1) / block_width;
+  size_t height_blocks = (height + block_height - 1) / block_height;
+
+  layout->width = width;
+  layout->height = height;
+  layout->surface_bytes = pitch_blocks * height_blocks * block_bytes;
+  layout->column_offset = malloc(width * sizeof(size_t));
+  layout->row_offset = malloc(height * sizeof(size_t));
+  assert(layout->column_offset != NULL && layout->row_offset != NULL);
+
+  for (u32 x = 0; x < width; x++)
+    layout->column_offset[x] = (x / block_width) * block_bytes
+      + deposit_coord(mode->bits, 'x', x % block_width);
+  for (u32 y = 0; y < height; y++)
+    layout->row_offset[y] = (y / block_height) * pitch_blocks * block_bytes
+      + deposit_coord(mode->bits, 'y', y % block_height);
+}
+
+struct linear_job {
+  pthread_t thread;
+  const struct linear_layout *layout;
+  const u8 *surface;
+  u8 *image;
+  u32 first_row;
+  u32 end_row;
+};
+
+static void *
+linearize_rows(void *arg)
+{
+  struct linear_job *job = arg;
+  const struct linear_layout *layout = job->layout;
+  u32 width = layout->width;
+
+  for (u32 y = job->first_row; y < job->end_row; y++) {
+    const u8 *src = job->surface + layout->row_offset[y];
+    u8 *dst = job->image + (size_t)y * width * 4;
+    u32 x = 0;
+
+    /* X0 and X1 are the lowest address bits in every mode, so four
+       pixels starting at a multiple of four are contiguous */
+    for (; x + 4 <= width; x += 4)
+      memcpy(dst + x * 4, src + layout->column_offset[x], 16);
+    for (; x < width; x++)
+      memcpy(dst + x * 4, src + layout->column_offset[x], 4);
+  }
+
+  return NULL;
+}
+
+static void
+linearize_surface(const struct linear_layout *layout, const u8 *surface,
+                  u8 *image, int nthreads)
+{
+  int rv;
+
+  if (nthreads > layout->height)
+    nthreads = layout->height;
+  struct linear_job *jobs = calloc(nthreads, sizeof(*jobs));
+  assert(jobs != NULL);
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].layout = layout;
+    jobs[t].surface = surface;
+    jobs[t].image = image;
+    jobs[t].first_row = (size_t)layout->height * t / nthreads;
+    jobs[t].end_row = (size_t)layout->height * (t+1) / nthreads;
+    rv = pthread_create(&jobs[t].thread, NULL, linearize_rows, &jobs[t]);
+    assert(rv == 0);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    rv = pthread_join(jobs[t].thread, NULL);
+    assert(rv == 0);
+  }
+  free(jobs);
+}
+
+static void
+decode_surface(const char *surface_name, const char *dcc_name,
+               const char *output_name, const struct linear_layout *layout,
+               int nthreads)
+{
+  size_t surface_len, dcc_len = 0;
+  const u8 *surface = map_input(surface_name, &surface_len);
+  const u8 *dcc = NULL;
+
+  size_t nblocks = surface_len / BLOCK_BYTES;
+  if (nblocks == 0) {
+    fprintf(stderr, "%s: %zu bytes, less than one %d-byte block.\n",
+            surface_name, surface_len, BLOCK_BYTES);
+    exit(EXIT_FAILURE);
+  }
+  if (dcc_name != NULL) {
+    dcc = map_input(dcc_name, &dcc_len);
+    if (dcc_len < nblocks)
+      nblocks = dcc_len;
+    if (nblocks * BLOCK_BYTES != surface_len || nblocks != dcc_len)
+      fprintf(stderr, "Warning: decoding only the first %zu blocks.\n",
+              nblocks);
+  }
+
+  if (layout != NULL && nblocks * BLOCK_BYTES < layout->surface_bytes) {
+    fprintf(stderr, "Surface too small for a %ux%u image (%zu of %zu bytes).\n",
+            layout->width, layout->height, nblocks * BLOCK_BYTES,
+            layout->surface_bytes);
+    exit(EXIT_FAILURE);
+  }
+
+  /* without a linear layout, the decoded blocks are the output */
+  size_t output_len = (layout != NULL)
+    ? (size_t)layout->width * layout->height * 4 : nblocks * BLOCK_BYTES;
+  u8 *output = map_output(output_name, output_len);
+  const u8 *decoded = surface;
+
+  if (dcc != NULL) {
+    u8 *blocks = output;
+    if (layout != NULL) {
+      blocks = malloc(nblocks * BLOCK_BYTES);
+      assert(blocks != NULL);
+    }
+
+    struct surface_job proto = { .surface = surface, .dcc = dcc,
+                                 .output = blocks };
+    struct surface_job total;
+    run_surface_jobs(&proto, nblocks, nthreads, decode_surface_blocks, &total);
+
+    print_histogram(&total, nblocks);
+    if (total.unsupported != 0)
+      printf("%zu blocks with unsupported DCC values written as zeros.\n",
+             total.unsupported);
+    if (total.malformed != 0)
+      printf("%zu malformed blocks written as zeros.\n", total.malformed);
+    decoded = blocks;
+  }
+
+  if (layout != NULL)
+    linearize_surface(layout, decoded, output, nthreads);
+
+  unmap_output(output, output_len);
+  if (decoded != surface && decoded != output)
+    free((void *)decoded);
+  munmap((void *)surface, surface_len);
+  if (dcc != NULL)
+    munmap((void *)dcc, dcc_len);
+}
+
+static void
+encode_surface(const char *surface_name, const char *dcc_name, int nthreads)
+{
+  size_t surface_len;
+  const u8 *surface = map_input(surface_name, &surface_len);
+
+  size_t nblocks = surface_len / BLOCK_BYTES;
+  if (nblocks == 0) {
+    fprintf(stderr, "%s: %zu bytes, less than one %d-byte block.\n",
+            surface_name, surface_len, BLOCK_BYTES);
+    exit(EXIT_FAILURE);
+  }
+  if (nblocks * BLOCK_BYTES != surface_len)
+    fprintf(stderr, "Warning: encoding only the first %zu blocks.\n",
+            nblocks);
+
+  u8 *dcc = map_output(dcc_name, nblocks);
+
+  struct surface_job proto = { .surface = surface, .output = dcc };
+  struct surface_job total;
+  run_surface_jobs(&proto, nblocks, nthreads, encode_surface_blocks, &total);
+
+  print_histogram(&total, nblocks);
+  printf("Compressed payload: %zu bits (%.1f%% of the uncompressed size).\n",
+         total.payload_bits,
+         100.0 * total.payload_bits / (8.0 * nblocks * BLOCK_BYTES));
+
+  unmap_output(dcc, nblocks);
+  munmap((void *)surface, surface_len);
+}
+
+static void
+usage(void)
+{
+  printf("Usage: decode-amd [-t] -d dcc\n"
+         "       decode-amd -s surface [-m dcc] -o output [-w width -h height\n"
+         "                  [-S 256B|4K|64K]] [-j threads]\n"
+         "       decode-amd -e [-t] [-z]\n"
+         "       decode-amd -e -s surface -m dcc [-j threads]\n");
+  exit(EXIT_FAILURE);
+}
+
+static u8 in[IN_BYTES];
+static u8 out[OUT_BYTES];
+
+/* read up to len bytes, returning how many there were */
+static int
+read_text(u8 *buf, int len)
 {
   int i;
+  for (i = 0; i < len; i++) {
+    if (scanf(" %hhx", &buf[i]) != 1)
+      break;
+  }
+  return i;
+}
 
+static int
+read_raw(u8 *buf, int len)
+{
+  return fread(buf, 1, len, stdin);
+}
+
+static void
+write_hex(const u8 *buf, int len)
+{
+  for (int i = 0; i < len; i++)
+    printf("%02X%c", buf[i], (i % 16 == 15)? '\n' : ' ');
+}
+
+static void
+write_text(void)
+{
   printf("First cacheline:\n");
-  for (i = 0; i < 64; i++)
-    printf("%02X%c", out[i], (i % 16 == 15)? '\n' : ' ');
+  write_hex(out, 64);
 
   printf("\nSecond cacheline:\n");
-  for (; i < 128; i++)
-    printf("%02X%c", out[i], (i % 16 == 15)? '\n' : ' ');
+  write_hex(out + 64, 64);
 
   printf("\nThird cacheline:\n");
-  for (; i < 192; i++)
-    printf("%02X%c", out[i], (i % 16 == 15)? '\n' : ' ');
+  write_hex(out + 128, 64);
 
   printf("\nFourth cacheline:\n");
-  for (; i < 256; i++)
-    printf("%02X%c", out[i], (i % 16 == 15)? '\n' : ' ');
+  write_hex(out + 192, 64);
 }
 
 static void
-write_raw(void)
+write_raw(const u8 *buf, int len)
 {
-  size_t nb = fwrite(out, 1, 256, stdout);
-  assert(nb == 256);
+  size_t nb = fwrite(buf, 1, len, stdout);
+  assert(nb == len);
+}
+
+/* encode the block in out into in, checking that it decodes back */
+static void
+encode_block(int text_mode, int size_only)
+{
+  int payload_bits;
+  u8 dcc;
+
+  if (size_only) {
+    dcc = encoded_dcc(out, &payload_bits);
+    printf("DCC %02x: %d bits\n", dcc, payload_bits);
+    return;
+  }
+
+  dcc = encode_amd(out, in, &payload_bits);
+  fprintf(stderr, "DCC %02x: %d bits\n", dcc, payload_bits);
+
+  u8 roundtrip[OUT_BYTES];
+  struct amd_decoder d;
+  init_decoder(&d, in, dcc_payload_bytes(dcc), roundtrip);
+  decode_amd(&d, dcc);
+  assert(d.error == NULL);
+  assert(memcmp(roundtrip, out, OUT_BYTES) == 0);
+
+  if (text_mode)
+    write_hex(in, dcc_payload_bytes(dcc));
+  else
+    write_raw(in, dcc_payload_bytes(dcc));
 }
 
 int
 main(int argc, char *argv[])
 {
   int text_mode = 0;
+  int encode_mode = 0;
+  int size_only = 0;
   long dcc = -1;
+  char *surface_name = NULL;
+  char *dcc_name = NULL;
+  char *output_name = NULL;
+  long width = 0, height = 0;
+  const struct swizzle_mode *swizzle = find_swizzle_mode("64K");
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
   int opt;
-  while ( (opt = getopt(argc, argv, "d:t")) != -1) {
+  while ( (opt = getopt(argc, argv, "d:ts:m:o:j:ezw:h:S:")) != -1) {
     switch (opt) {
     case 't':
       text_mode = 1;
@@ -451,25 +1415,105 @@ main(int argc, char *argv[])
     case 'd':
       dcc = strtol(optarg, NULL, 16);
       break;
+    case 's':
+      surface_name = optarg;
+      break;
+    case 'm':
+      dcc_name = optarg;
+      break;
+    case 'o':
+      output_name = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    case 'e':
+      encode_mode = 1;
+      break;
+    case 'z':
+      size_only = 1;
+      break;
+    case 'w':
+      width = atol(optarg);
+      break;
+    case 'h':
+      height = atol(optarg);
+      break;
+    case 'S':
+      swizzle = find_swizzle_mode(optarg);
+      if (swizzle == NULL)
+        usage();
+      break;
     default:
       usage();
     }
   }
+  if (nthreads < 1)
+    nthreads = 1;
+
+  if (encode_mode) {
+    if (surface_name != NULL || dcc_name != NULL) {
+      if (surface_name == NULL || dcc_name == NULL || output_name != NULL)
+        usage();
+      encode_surface(surface_name, dcc_name, nthreads);
+      return 0;
+    }
+
+    int nb = text_mode ? read_text(out, OUT_BYTES) : read_raw(out, OUT_BYTES);
+    if (nb != OUT_BYTES) {
+      fprintf(stderr, "Expected %d bytes of input, got %d.\n", OUT_BYTES, nb);
+      exit(EXIT_FAILURE);
+    }
+    encode_block(text_mode, size_only);
+    return 0;
+  }
+
+  if (surface_name != NULL || dcc_name != NULL || output_name != NULL) {
+    if (surface_name == NULL || output_name == NULL)
+      usage();
+    if ((width != 0) != (height != 0) || width < 0 || height < 0
+        || width > UINT16_MAX || height > UINT16_MAX)
+      usage();
+    /* without DCC metadata, the surface is taken as already decoded */
+    if (dcc_name == NULL && width == 0)
+      usage();
+
+    struct linear_layout layout;
+    if (width != 0)
+      init_layout(&layout, swizzle, width, height);
+    decode_surface(surface_name, dcc_name, output_name,
+                   (width != 0)? &layout : NULL, nthreads);
+    return 0;
+  }
 
   if (dcc < 0 || dcc > 255)
     usage();
 
-  if (text_mode)
-    read_text();
-  else
-    read_raw();
+  if (!dcc_layouts[dcc].known) {
+    fprintf(stderr, "DCC mode %lx not (yet) supported.\n", dcc);
+    exit(EXIT_FAILURE);
+  }
+
+  int payload_bytes = dcc_payload_bytes(dcc);
+  int nb = text_mode ? read_text(in, payload_bytes) : read_raw(in, payload_bytes);
+  if (nb < payload_bytes)
+    fprintf(stderr,
+            "Warning: %d of %d payload bytes given; the rest are taken as zero.\n",
+            nb, payload_bytes);
 
-  decode_amd(dcc);
+  struct amd_decoder d;
+  init_decoder(&d, in, payload_bytes, out);
+  decode_amd(&d, dcc);
+  if (d.error != NULL) {
+    fprintf(stderr, "Malformed compressed input (failed check: %s).\n",
+            d.error);
+    exit(EXIT_FAILURE);
+  }
 
   if (text_mode)
     write_text();
   else
-    write_raw();
+    write_raw(out, OUT_BYTES);
 
   return 0;
 }
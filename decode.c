@@ -2,11 +2,17 @@
  * Copyright 2023 Hovav Shacham.  All rights reserved; see LICENSE file.
  */
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef uint8_t u8;
 
@@ -14,13 +20,30 @@ static u8 in[64];
 static u8 in_byte_idx = 0;
 static u8 in_bit_idx  = 0;
 
+/*
+ * Malformed input is not a programming error, so rather than assert
+ * on it we record the first failed check and keep going; once a check
+ * has failed, read_bits returns zeros and the caller is expected to
+ * discard whatever was decoded.
+ */
+static const char *decode_error = NULL;
+
+#define check(cond)                                     \
+  do {                                                  \
+    if (!(cond) && decode_error == NULL)                \
+      decode_error = #cond;                             \
+  } while (0)
+
 static u8
 read_bits(u8 count)
 {
   u8 retval = 0;
 
+  check(in_byte_idx < 64 || count == 0);
+  if (decode_error != NULL)
+    return 0;
+
   assert(count <= 8);
-  assert(in_byte_idx < 64);
 
   if (count == 0)
     return 0;
@@ -37,7 +60,9 @@ read_bits(u8 count)
 
     retval = in[in_byte_idx] >> in_bit_idx;
     in_byte_idx++; in_bit_idx = 0;
-    assert(in_byte_idx < 64);
+    check(in_byte_idx < 64);
+    if (decode_error != NULL)
+      return 0;
 
     retval += (in[in_byte_idx]  & ((1 << second_byte_bits) - 1))
                 << first_byte_bits;
@@ -54,12 +79,12 @@ read_and_discard_zero_bits(u8 count)
 
   while (count > 8) {
     bits = read_bits(8);
-    assert(bits == 0);
+    check(bits == 0);
     count -= 8;
   }
 
   bits = read_bits(count);
-  assert(bits == 0);
+  check(bits == 0);
 }
 
 struct bitbuffer {
@@ -106,7 +131,9 @@ read_buffered_bits(struct bitbuffer *bb, u8 count)
 
   assert(bb != NULL);
   assert(count <= 8);
-  assert(bb->bits_used >= count);
+  check(bb->bits_used >= count);
+  if (decode_error != NULL)
+    return 0;
 
   retval = (u8)(bb->buf & ( (((uint32_t)1) << count) - 1 ));
   bb->buf >>= count;
@@ -120,9 +147,11 @@ read_and_discard_buffered_zero_bits(struct bitbuffer *bb, u8 count)
 {
   assert(bb != NULL);
   assert(count <= 8);
-  assert(bb->bits_used >= count);
+  check(bb->bits_used >= count);
+  if (decode_error != NULL)
+    return;
 
-  assert(( bb->buf & ( (((uint32_t)1) << count) - 1 ) ) == 0);
+  check(( bb->buf & ( (((uint32_t)1) << count) - 1 ) ) == 0);
   bb->buf >>= count;
   bb->bits_used -= count;
 }
@@ -175,26 +204,28 @@ decode_8th_gen(void)
 
   u8 delta_r_bits = read_bits(3);
   if (skip_r)
-    assert(delta_r_bits == 0);
+    check(delta_r_bits == 0);
   else
     delta_r_bits++;
   u8 delta_g_bits = read_bits(3);
   if (skip_g)
-    assert(delta_g_bits == 0);
+    check(delta_g_bits == 0);
   else
     delta_g_bits++;
   u8 delta_b_bits = read_bits(3);
   if (skip_b)
-    assert(delta_b_bits == 0);
+    check(delta_b_bits == 0);
   else
     delta_b_bits++;
   u8 delta_a_bits = read_bits(3);
   if (skip_a)
-    assert(delta_a_bits == 0);
+    check(delta_a_bits == 0);
   else
     delta_a_bits++;
 
-  assert(delta_r_bits + delta_g_bits + delta_b_bits + delta_a_bits <= 14);
+  check(delta_r_bits + delta_g_bits + delta_b_bits + delta_a_bits <= 14);
+  if (decode_error != NULL)
+    return;
 
   u8 unused_bits = 14 - (delta_r_bits + delta_g_bits + delta_b_bits + delta_a_bits);
   
@@ -235,7 +266,9 @@ decode_11th_gen_extension(u8 inter_pred, u8 extension_bits)
     if (subwindow_is_uniform[sw])
       num_uniform_subwindows++;
   }
-  assert(num_uniform_subwindows == 4); /* can it be more? */
+  check(num_uniform_subwindows == 4); /* can it be more? */
+  if (decode_error != NULL)
+    return;
 
   u8 delta_r_bits;
   u8 delta_g_bits;
@@ -252,10 +285,12 @@ decode_11th_gen_extension(u8 inter_pred, u8 extension_bits)
     delta_g_bits = read_bits(4);
     delta_b_bits = read_bits(4);
   }
-  assert(delta_r_bits <= 8);
-  assert(delta_g_bits <= 8);
-  assert(delta_b_bits <= 8);
-  assert(delta_r_bits + delta_g_bits + delta_b_bits <= 22);
+  check(delta_r_bits <= 8);
+  check(delta_g_bits <= 8);
+  check(delta_b_bits <= 8);
+  check(delta_r_bits + delta_g_bits + delta_b_bits <= 22);
+  if (decode_error != NULL)
+    return;
 
   /* a bits not specified; limit to 8, discard remainder  */
   delta_a_bits = 22 - (delta_r_bits + delta_g_bits + delta_b_bits);
@@ -399,7 +434,7 @@ decode_11th_gen(int ccs)
 
   u8 extension_bits = read_bits(8);
   if (extension_bits != 0) {
-    assert(ccs == 6);           /* not observed in other variants */
+    check(ccs == 6);            /* not observed in other variants */
     decode_11th_gen_extension(inter_pred, extension_bits);
     return;
   }
@@ -419,10 +454,12 @@ decode_11th_gen(int ccs)
     delta_g_bits = read_bits(4);
     delta_b_bits = read_bits(4);
   }
-  assert(delta_r_bits <= 8);
-  assert(delta_g_bits <= 8);
-  assert(delta_b_bits <= 8);
-  assert(delta_r_bits + delta_g_bits + delta_b_bits <= bits_per_pixel);
+  check(delta_r_bits <= 8);
+  check(delta_g_bits <= 8);
+  check(delta_b_bits <= 8);
+  check(delta_r_bits + delta_g_bits + delta_b_bits <= bits_per_pixel);
+  if (decode_error != NULL)
+    return;
 
   /* a bits not specified; limit to 8, discard remainder  */
   delta_a_bits = bits_per_pixel - (delta_r_bits + delta_g_bits
@@ -493,10 +530,228 @@ decode_11th_gen(int ccs)
                              - pixels_recovered * bits_per_pixel);
 }
 
+/*
+ * Verification mode.
+ *
+ * dump writes out every i915 GEM mapping big enough to hold the
+ * texture.  Among them are the linear array handed to glTexImage2D
+ * and the Y-tiled surface the GPU built from it.  We don't get to see
+ * the CCS metadata, so a cacheline pair in the tiled surface is
+ * accepted if it either matches the linear data verbatim or decodes
+ * to it; anything else is a mismatch, and (assuming the pairing is
+ * right) points at a gap in the decoder.
+ */
+
+#define CACHELINE_BYTES 64
+#define PAIR_BYTES      (2 * CACHELINE_BYTES)
+#define TILE_ROW_BYTES  128     /* Y tile is 128 bytes by 32 rows */
+#define TILE_ROWS       32
+#define TILE_BYTES      (TILE_ROW_BYTES * TILE_ROWS)
+#define OWORD_BYTES     16      /* tile column: 32 rows of 16 bytes */
+#define PAIR_ROWS       (PAIR_BYTES / OWORD_BYTES)
+
+struct candidate {
+  const char *name;
+  const u8 *data;
+  size_t len;
+};
+
+struct verify_counts {
+  size_t verbatim;
+  size_t decoded;
+  size_t mismatched;
+  size_t skipped;
+};
+
+static int
+cacheline_equal(const u8 *a, const u8 *b)
+{
+#ifdef __SSE2__
+  __m128i diff = _mm_setzero_si128();
+  for (int i = 0; i < CACHELINE_BYTES; i += 16)
+    diff = _mm_or_si128(diff,
+                        _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a+i)),
+                                      _mm_loadu_si128((const __m128i *)(b+i))));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xffff;
+#else
+  return memcmp(a, b, CACHELINE_BYTES) == 0;
+#endif
+}
+
+/* decode one compressed cacheline into out; returns 0 if it was malformed */
+static int
+decode_cacheline(const u8 *src, int generation, int ccs)
+{
+  memcpy(in, src, sizeof(in));
+  in_byte_idx = 0;
+  in_bit_idx = 0;
+  out_idx = 0;
+  decode_error = NULL;
+
+  if (generation == 8)
+    decode_8th_gen();
+  else
+    decode_11th_gen(ccs);
+
+  return decode_error == NULL;
+}
+
+static void
+verify_candidates(const struct candidate *linear,
+                  const struct candidate *tiled,
+                  int width, int height, int generation, int ccs,
+                  int report, struct verify_counts *counts)
+{
+  size_t row_bytes = (size_t)width * 4;
+  size_t pitch = (row_bytes + TILE_ROW_BYTES - 1) / TILE_ROW_BYTES * TILE_ROW_BYTES;
+  size_t tiles_per_row = pitch / TILE_ROW_BYTES;
+  size_t tile_rows = (height + TILE_ROWS - 1) / TILE_ROWS;
+  u8 expected[PAIR_BYTES];
+
+  memset(counts, 0, sizeof(*counts));
+
+  for (size_t tile = 0; tile < tiles_per_row * tile_rows; tile++) {
+    size_t tile_x = (tile % tiles_per_row) * TILE_ROW_BYTES;
+    size_t tile_y = (tile / tiles_per_row) * TILE_ROWS;
+
+    for (size_t pos = 0; pos < TILE_BYTES; pos += PAIR_BYTES) {
+      size_t offset = tile * TILE_BYTES + pos;
+      size_t x = tile_x + (pos / (TILE_ROWS * OWORD_BYTES)) * OWORD_BYTES;
+      size_t y = tile_y + (pos % (TILE_ROWS * OWORD_BYTES)) / OWORD_BYTES;
+
+      if (x + OWORD_BYTES > row_bytes || y + PAIR_ROWS > height
+          || offset + PAIR_BYTES > tiled->len) {
+        counts->skipped++;
+        continue;
+      }
+
+      for (int r = 0; r < PAIR_ROWS; r++)
+        memcpy(expected + r * OWORD_BYTES,
+               linear->data + (y + r) * row_bytes + x, OWORD_BYTES);
+
+      const u8 *actual = tiled->data + offset;
+      if (cacheline_equal(actual, expected)
+          && cacheline_equal(actual + CACHELINE_BYTES,
+                             expected + CACHELINE_BYTES)) {
+        counts->verbatim++;
+        continue;
+      }
+
+      int decoded = decode_cacheline(actual, generation, ccs);
+      if (decoded) {
+        int first_ok  = cacheline_equal(out, expected);
+        int second_ok = cacheline_equal(out + CACHELINE_BYTES,
+                                        expected + CACHELINE_BYTES);
+        if (first_ok && second_ok) {
+          counts->decoded++;
+          continue;
+        }
+      }
+
+      counts->mismatched++;
+      if (report) {
+        const u8 *got = decoded ? out : actual;
+        for (int cl = 0; cl < 2; cl++) {
+          if (cacheline_equal(got + cl * CACHELINE_BYTES,
+                              expected + cl * CACHELINE_BYTES))
+            continue;
+          printf("%s: cacheline at 0x%zx (x %zu, y %zu) %s\n",
+                 tiled->name, offset + cl * CACHELINE_BYTES,
+                 x / 4, y + cl * (PAIR_ROWS / 2),
+                 decoded ? "decodes to wrong pixels"
+                         : "neither verbatim nor decodable");
+        }
+      }
+    }
+  }
+}
+
+static void
+map_candidate(struct candidate *c, const char *name)
+{
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    perror(name);
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  int rv = fstat(fd, &st);
+  assert(rv == 0);
+
+  c->name = name;
+  c->len = st.st_size;
+  c->data = NULL;
+  if (c->len > 0) {
+    c->data = mmap(NULL, c->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(c->data != MAP_FAILED);
+  }
+  close(fd);
+}
+
+/*
+ * Try every (linear, tiled) ordering of the candidates, keep the one
+ * where the most cacheline pairs check out, and report its
+ * mismatches.  Returns the number of mismatched pairs.
+ */
+static size_t
+verify(int ncandidates, char *names[], int width, int height,
+       int generation, int ccs)
+{
+  struct candidate *candidates = calloc(ncandidates, sizeof(*candidates));
+  assert(candidates != NULL);
+  for (int i = 0; i < ncandidates; i++)
+    map_candidate(&candidates[i], names[i]);
+
+  size_t linear_len = (size_t)width * height * 4;
+  int best_linear = -1, best_tiled = -1;
+  size_t best_score = 0;
+  struct verify_counts counts;
+
+  for (int l = 0; l < ncandidates; l++) {
+    if (candidates[l].len < linear_len)
+      continue;
+    for (int t = 0; t < ncandidates; t++) {
+      if (t == l || candidates[t].len == 0)
+        continue;
+      verify_candidates(&candidates[l], &candidates[t], width, height,
+                        generation, ccs, 0, &counts);
+      size_t score = counts.verbatim + counts.decoded;
+      if (best_linear == -1 || score > best_score) {
+        best_linear = l;
+        best_tiled = t;
+        best_score = score;
+      }
+    }
+  }
+
+  if (best_linear == -1) {
+    fprintf(stderr, "No pair of candidates fits a %dx%d texture.\n",
+            width, height);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("linear: %s\ntiled:  %s\n",
+         candidates[best_linear].name, candidates[best_tiled].name);
+  verify_candidates(&candidates[best_linear], &candidates[best_tiled],
+                    width, height, generation, ccs, 1, &counts);
+  printf("cacheline pairs: %zu verbatim, %zu decoded, %zu mismatched, "
+         "%zu skipped\n", counts.verbatim, counts.decoded,
+         counts.mismatched, counts.skipped);
+
+  for (int i = 0; i < ncandidates; i++)
+    if (candidates[i].data != NULL)
+      munmap((void *)candidates[i].data, candidates[i].len);
+  free(candidates);
+
+  return counts.mismatched;
+}
+
 static void
 usage(void)
 {
-  printf("Usage: decode [-t] [-g 8|11] -c [1|2|6|8]\n");
+  printf("Usage: decode [-t] [-g 8|11] -c [1|2|6|8]\n"
+         "       decode -V [-g 8|11] [-c 1|6] -w width -h height candidate...\n");
   exit(EXIT_FAILURE);
 }
 
@@ -542,15 +797,27 @@ int
 main(int argc, char *argv[])
 {
   int text_mode = 0;
+  int verify_mode = 0;
   int generation = 8;
   int ccs = -1;
+  int width = 0;
+  int height = 0;
 
   int opt;
-  while ( (opt = getopt(argc, argv, "g:c:t")) != -1) {
+  while ( (opt = getopt(argc, argv, "g:c:tVw:h:")) != -1) {
     switch (opt) {
     case 't':
       text_mode = 1;
       break;
+    case 'V':
+      verify_mode = 1;
+      break;
+    case 'w':
+      width = atoi(optarg);
+      break;
+    case 'h':
+      height = atoi(optarg);
+      break;
     case 'g':
       generation = atoi(optarg);
       break;
@@ -562,6 +829,19 @@ main(int argc, char *argv[])
     }
   }
 
+  if (verify_mode) {
+    if (width <= 0 || height <= 0 || optind == argc)
+      usage();
+    if (generation != 8 && generation != 11)
+      usage();
+    /* only the pair modes map one cacheline onto a whole pair */
+    if (generation == 11 && ccs != 1 && ccs != 6)
+      usage();
+    size_t mismatched = verify(argc - optind, argv + optind,
+                               width, height, generation, ccs);
+    return mismatched == 0 ? 0 : EXIT_FAILURE;
+  }
+
   if (text_mode)
     read_text();
   else
@@ -580,6 +860,12 @@ main(int argc, char *argv[])
     usage();
   }
 
+  if (decode_error != NULL) {
+    fprintf(stderr, "Malformed compressed input (failed check: %s).\n",
+            decode_error);
+    exit(EXIT_FAILURE);
+  }
+
   if (text_mode)
     write_text();
   else
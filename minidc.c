@@ -18,19 +18,33 @@
 #include <assert.h>
 #include <err.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/random.h>
+#include <time.h>
 
 #include "siphash.h"
 #include "minidc.h"
 
 static uint8_t prf_key[PRF_KEYLEN];
 
+/* the PRFs $ can use, by the names select_prf takes */
+static const struct {
+  const char *name;
+  int crounds, drounds;
+} prfs[] = {
+  { "siphash-2-4", 2, 4 },      /* the default */
+  { "siphash-1-3", 1, 3 },
+};
+static int prf_index;
+static struct siphash_state prf_start;  /* the key, and no words yet */
+
 struct bmachine {
   word *stack;
   size_t stacksize;
@@ -39,10 +53,30 @@ struct bmachine {
   unsigned int ibase;
   char *progstr;
   size_t progpos;
+  size_t progend;               /* of the macro running, if any */
   int lastchar;
+
+  /*
+   * Registers, each holding a number or the text of a macro.  A string
+   * is never on the stack: the text of [ ], or of a macro loaded with l,
+   * is kept aside for the s or x that must come next.
+   */
+  word regs[UCHAR_MAX + 1];
+  bool reg_macro[UCHAR_MAX + 1];
+  size_t macro_start[UCHAR_MAX + 1], macro_len[UCHAR_MAX + 1];
+  bool string;
+  size_t string_start, string_len;
+  int nesting;                  /* of macros running */
 };
 
-static struct bmachine bmachine;
+/*
+ * How deeply x may run macros that run macros.  Without conditionals,
+ * a macro that runs itself never stops.
+ */
+#define MAX_NESTING 64
+
+/* eval() is the reference, not the fast path, but may run in any thread */
+static __thread struct bmachine bmachine;
 
 static void stack_init(void);
 static void stack_clear(void);
@@ -88,101 +122,168 @@ static void moreeq_numbers(void);
 static void nop(void);
 static void parse_number(void);
 static void prf(void);
+static void store(void);
+static void load(void);
+static void push_line(void);
+static void eval_tos(void);
 static void unknown(void);
 
 typedef void (*opcode_function)(void);
 
+/*
+ * Bytecode for compiled programs (see compile_prog below).  Each
+ * command character maps to one opcode; numbers become OP_PUSH with
+ * the parsed value, or OP_PUSH_DIGITS when the input base is not known
+ * until run time.
+ */
+enum dc_op {
+  OP_END,
+  OP_NOP,
+  OP_PUSH,
+  OP_PUSH_DIGITS,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_DIVMOD,
+  OP_NOT,
+  OP_OR,
+  OP_AND,
+  OP_BOR,
+  OP_BAND,
+  OP_BXOR,
+  OP_SHL,
+  OP_SHR,
+  OP_EQ,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_DUP,
+  OP_SWAP,
+  OP_ROT,
+  OP_DROP,
+  OP_CLEAR,
+  OP_DEPTH,
+  OP_GET_IBASE,
+  OP_SET_IBASE,
+  OP_PRF,
+  OP_UNDERFLOW,                 /* where the stack runs out; always fails */
+  OP_STORE,                     /* pop into register slot arg */
+  OP_LOAD,                      /* push register slot arg */
+
+  /* produced only by optimize_prog, with the constant operand in arg */
+  OP_ADD_IMM,
+  OP_MUL_IMM,
+  OP_DIV_IMM,
+  OP_MOD_IMM,
+  OP_BOR_IMM,
+  OP_BAND_IMM,
+  OP_BXOR_IMM,
+  OP_SHL_IMM,
+  OP_SHR_IMM,
+  OP_DIV_POW2,                  /* divide by 1 << arg */
+  OP_MOD_POW2,                  /* remainder mod 1 << arg */
+
+  /* in dataflow graphs only: argument number arg */
+  OP_ARG,
+  NUM_OPS
+};
+
 struct jump_entry {
   u_char ch;
   opcode_function f;
+  u_char op;                    /* bytecode for compile_prog */
 };
 
 static opcode_function jump_table[UCHAR_MAX + 1];
+static u_char op_table[UCHAR_MAX + 1];
 
 static const struct jump_entry jump_table_data[] = {
-	{ ' ',	nop		},
+	{ ' ',	nop,		OP_NOP	},
      /* { '!',	not_compare	}, */
      /* { '#',	comment		}, */
-	{ '$',	prf		},
-	{ '%',	bmod		},
-        { '&',	bitwise_and	},
-	{ '(',	less_numbers	},
-	{ ')',	more_numbers	},
-	{ '*',	bmul		},
-	{ '+',	badd		},
-	{ '-',	bsub		},
+	{ '$',	prf,		OP_PRF	},
+	{ '%',	bmod,		OP_MOD	},
+        { '&',	bitwise_and,	OP_BAND	},
+	{ '(',	less_numbers,	OP_LT	},
+	{ ')',	more_numbers,	OP_GT	},
+	{ '*',	bmul,		OP_MUL	},
+	{ '+',	badd,		OP_ADD	},
+	{ '-',	bsub,		OP_SUB	},
      /* { '.',	parse_number	}, */
-	{ '/',	bdiv		},
-	{ '0',	parse_number	},
-	{ '1',	parse_number	},
-	{ '2',	parse_number	},
-	{ '3',	parse_number	},
-	{ '4',	parse_number	},
-	{ '5',	parse_number	},
-	{ '6',	parse_number	},
-	{ '7',	parse_number	},
-	{ '8',	parse_number	},
-	{ '9',	parse_number	},
+	{ '/',	bdiv,		OP_DIV	},
+	{ '0',	parse_number,	OP_PUSH	},
+	{ '1',	parse_number,	OP_PUSH	},
+	{ '2',	parse_number,	OP_PUSH	},
+	{ '3',	parse_number,	OP_PUSH	},
+	{ '4',	parse_number,	OP_PUSH	},
+	{ '5',	parse_number,	OP_PUSH	},
+	{ '6',	parse_number,	OP_PUSH	},
+	{ '7',	parse_number,	OP_PUSH	},
+	{ '8',	parse_number,	OP_PUSH	},
+	{ '9',	parse_number,	OP_PUSH	},
      /* { ':',	store_array	}, */
      /* { ';',	load_array	}, */
-        { '<',	bitwise_lshift	},
+        { '<',	bitwise_lshift,	OP_SHL	},
      /* { '<',	less		}, */
      /* { '=',	equal		}, */
-        { '>',	bitwise_rshift	},
+        { '>',	bitwise_rshift,	OP_SHR	},
      /* { '>',	greater		}, */
      /* { '?',	eval_line	}, */
-	{ 'A',	parse_number	},
-	{ 'B',	parse_number	},
-	{ 'C',	parse_number	},
-	{ 'D',	parse_number	},
-	{ 'E',	parse_number	},
-	{ 'F',	parse_number	},
-	{ 'G',	equal_numbers	},
-	{ 'I',	get_ibase	},
+	{ 'A',	parse_number,	OP_PUSH	},
+	{ 'B',	parse_number,	OP_PUSH	},
+	{ 'C',	parse_number,	OP_PUSH	},
+	{ 'D',	parse_number,	OP_PUSH	},
+	{ 'E',	parse_number,	OP_PUSH	},
+	{ 'F',	parse_number,	OP_PUSH	},
+	{ 'G',	equal_numbers,	OP_EQ	},
+	{ 'I',	get_ibase,	OP_GET_IBASE	},
      /* { 'J',	skipN		}, */
      /* { 'K',	get_scale	}, */
      /* { 'L',	load_stack	}, */
      /* { 'M',	nop		}, */
-        { 'M',  and		},
-	{ 'N',	not		},
+        { 'M',  and,		OP_AND	},
+	{ 'N',	not,		OP_NOT	},
      /* { 'O',	get_obase	}, */
      /* { 'P',	pop_print	}, */
      /* { 'Q',	quitN		}, */
-	{ 'R',	drop		},
+	{ 'R',	drop,		OP_DROP	},
      /* { 'S',	store_stack	}, */
      /* { 'X',	push_scale	}, */
      /* { 'Z',	num_digits	}, */
-     /* { '[',	push_line	}, */
-	{ '\f',	nop		},
-	{ '\n',	nop		},
-	{ '\r',	nop		},
-	{ '\t',	nop		},
-        { '^',	bitwise_xor	},
+	{ '[',	push_line,	OP_NOP	},	/* expanded by compile_prog */
+	{ '\f',	nop,		OP_NOP	},
+	{ '\n',	nop,		OP_NOP	},
+	{ '\r',	nop,		OP_NOP	},
+	{ '\t',	nop,		OP_NOP	},
+        { '^',	bitwise_xor,	OP_BXOR	},
      /* { '^',	bexp		}, */
-	{ '_',	parse_number	},
+	{ '_',	parse_number,	OP_PUSH	},
      /* { 'a',	to_ascii	}, */
-	{ 'c',	clear_stack	},
-	{ 'd',	dup		},
+	{ 'c',	clear_stack,	OP_CLEAR	},
+	{ 'd',	dup,		OP_DUP	},
      /* { 'e',	print_err	}, */
      /* { 'f',	print_stack	}, */
-	{ 'i',	set_ibase	},
+	{ 'i',	set_ibase,	OP_SET_IBASE	},
      /* { 'k',	set_scale	}, */
-     /* { 'l',	load		}, */
-        { 'm',  or		},
+	{ 'l',	load,		OP_LOAD	},
+        { 'm',  or,		OP_OR	},
      /* { 'n',	pop_printn	}, */
      /* { 'o',	set_obase	}, */
      /* { 'p',	print_tos	}, */
      /* { 'q',	quit		}, */
-	{ 'r',	swap		},
-     /* { 's',	store		}, */
-	{ 't',	rot		},
+	{ 'r',	swap,		OP_SWAP	},
+	{ 's',	store,		OP_STORE	},
+	{ 't',	rot,		OP_ROT	},
      /* { 'v',	bsqrt		}, */
-     /* { 'x',	eval_tos	}, */
-	{ 'z',	stackdepth	},
-	{ '{',	lesseq_numbers	},
-        { '|',	bitwise_or	},
-	{ '}',	moreeq_numbers	},
-	{ '~',	bdivmod		}
+	{ 'x',	eval_tos,	OP_NOP	},	/* expanded by compile_prog */
+	{ 'z',	stackdepth,	OP_DEPTH	},
+	{ '{',	lesseq_numbers,	OP_LE	},
+        { '|',	bitwise_or,	OP_BOR	},
+	{ '}',	moreeq_numbers,	OP_GE	},
+	{ '~',	bdivmod, OP_DIVMOD	}
 };
 
 #ifndef nitems
@@ -194,13 +295,16 @@ init_dc(uint8_t *prf_key_val)
 {
   int i;
 
-  for (i = 0; i < nitems(jump_table); i++)
+  for (i = 0; i < nitems(jump_table); i++) {
     jump_table[i] = unknown;
+    op_table[i] = OP_NOP;
+  }
 
   for (i = 0; i < nitems(jump_table_data); i++) {
     assert((unsigned int)jump_table_data[i].ch < nitems(jump_table));
     assert(jump_table[jump_table_data[i].ch] == unknown);
     jump_table[jump_table_data[i].ch] = jump_table_data[i].f;
+    op_table[jump_table_data[i].ch] = jump_table_data[i].op;
   }
 
   bmachine.progstr = NULL;
@@ -217,6 +321,48 @@ init_dc(uint8_t *prf_key_val)
     rv = getentropy(prf_key, PRF_KEYLEN);
     assert(rv != -1);
   }
+  siphash_init(&prf_start, prf_key, prfs[prf_index].crounds,
+               prfs[prf_index].drounds);
+}
+
+/*
+ * Choose the PRF behind $, before init_dc; returns -1 if there is none
+ * by that name.  SipHash-1-3 is fine for picking random numbers, which
+ * is all $ does, and runs 40% fewer rounds on a stack of a word or two.
+ */
+int
+select_prf(const char *name)
+{
+  for (size_t i = 0; i < nitems(prfs); i++) {
+    if (strcmp(prfs[i].name, name) == 0) {
+      prf_index = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *
+prf_name(void)
+{
+  return prfs[prf_index].name;
+}
+
+/* the key $ uses, chosen at random by init_dc if it was not given one */
+void
+get_prf_key(uint8_t *key)
+{
+  memcpy(key, prf_key, PRF_KEYLEN);
+}
+
+/* the PRF of nwords words, before the reduction mod the range */
+static uint64_t
+prf_hash(const word *words, size_t nwords)
+{
+  struct siphash_state st = prf_start;
+
+  siphash_absorb(&st, (const uint64_t *)words, nwords);
+  return siphash_finish(&st);
 }
 
 void
@@ -225,10 +371,15 @@ reset_for_prog(char *prog)
   assert(prog != NULL);
   bmachine.progstr = prog;
   bmachine.progpos = 0;
+  bmachine.progend = strlen(prog);
   bmachine.lastchar = -1;
 
   stack_clear();
   bmachine.ibase = 10;
+  memset(bmachine.regs, 0, sizeof(bmachine.regs));
+  memset(bmachine.reg_macro, 0, sizeof(bmachine.reg_macro));
+  bmachine.string = false;
+  bmachine.nesting = 0;
 }
 
 static void
@@ -308,7 +459,8 @@ readch(void)
 {
   assert(bmachine.progstr != NULL);
   
-  bmachine.lastchar = (unsigned char)bmachine.progstr[bmachine.progpos];
+  bmachine.lastchar = (bmachine.progpos == bmachine.progend) ? '\0'
+    : (unsigned char)bmachine.progstr[bmachine.progpos];
   if (bmachine.lastchar == '\0') {
     return EOF;
   } else {
@@ -611,14 +763,89 @@ prf(void)
   word range = pop();
   assert(range > 0);
 
-  uint64_t prf_out;
-  siphash(bmachine.stack, (bmachine.sp+1)*sizeof(word),
-          prf_key, (uint8_t *)&prf_out, 8);
+  uint64_t prf_out = prf_hash(bmachine.stack, bmachine.sp + 1);
 
   uint64_t modout = prf_out % (uint64_t)range;
   push((word)modout);
 }
 
+static int
+readreg(void)
+{
+  int ch = readch();
+  assert(ch != EOF);
+  return ch;
+}
+
+static void
+store(void)
+{
+  int reg = readreg();
+
+  if (bmachine.string) {
+    bmachine.reg_macro[reg] = true;
+    bmachine.macro_start[reg] = bmachine.string_start;
+    bmachine.macro_len[reg] = bmachine.string_len;
+    bmachine.string = false;
+  } else {
+    bmachine.regs[reg] = pop();
+    bmachine.reg_macro[reg] = false;
+  }
+}
+
+/* a register never stored to holds 0, as in OpenBSD dc */
+static void
+load(void)
+{
+  int reg = readreg();
+
+  if (bmachine.reg_macro[reg]) {
+    bmachine.string = true;
+    bmachine.string_start = bmachine.macro_start[reg];
+    bmachine.string_len = bmachine.macro_len[reg];
+  } else {
+    push(bmachine.regs[reg]);
+  }
+}
+
+static void
+push_line(void)
+{
+  size_t start = bmachine.progpos;
+  int level = 1, ch;
+
+  while ((ch = readch()) != EOF)
+    if (ch == '[')
+      level++;
+    else if (ch == ']' && --level == 0)
+      break;
+  assert(ch != EOF);
+  bmachine.string = true;
+  bmachine.string_start = start;
+  bmachine.string_len = bmachine.progpos - 1 - start;
+}
+
+static void
+eval_tos(void)
+{
+  /* x of a number leaves it where it is */
+  if (!bmachine.string) {
+    assert(bmachine.sp != -1);
+    return;
+  }
+
+  size_t pos = bmachine.progpos, end = bmachine.progend;
+  assert(bmachine.nesting < MAX_NESTING);
+  bmachine.string = false;
+  bmachine.progpos = bmachine.string_start;
+  bmachine.progend = bmachine.string_start + bmachine.string_len;
+  bmachine.nesting++;
+  eval();
+  bmachine.nesting--;
+  bmachine.progpos = pos;
+  bmachine.progend = end;
+}
+
 static void
 unknown(void)
 {
@@ -632,12 +859,3688 @@ eval(void)
 
   for (;;) {
     ch = readch();
-    if (ch == EOF)
+    if (ch == EOF) {
+      /* a string may end a macro, but not the program */
+      assert(!bmachine.string || bmachine.nesting > 0);
       return;
+    }
 
-    if (0 <= ch && ch < nitems(jump_table))
-      (*jump_table[ch])();
-    else
+    if (0 <= ch && ch < nitems(jump_table)) {
+      opcode_function f = jump_table[ch];
+      assert(!bmachine.string || f == store || f == eval_tos || f == nop
+             || f == unknown);
+      (*f)();
+    } else
       unknown();
   }
 }
+
+/*
+ * Compiled programs.  eval() rereads the program text every time it
+ * runs; for the per-pixel programs of dump and tweak, which run
+ * millions of times, we instead compile the text once into bytecode
+ * and run that.  The semantics are exactly those of eval() after
+ * reset_for_prog() and pushing the arguments.  A program's results are
+ * the nresults values left on top of the stack, bottom first; run_prog
+ * returns the last of them, and run_prog_batch all of them.
+ */
+
+struct dc_insn {
+  u_char op;
+  word arg;
+};
+
+struct dc_prog {
+  struct dc_insn *code;
+  size_t ncode;
+  int nargs;
+  size_t max_depth;             /* deepest the stack gets while running */
+  int nregs;                    /* register slots, kept past the stack */
+  char *digits;                 /* NUL-separated text for OP_PUSH_DIGITS */
+  size_t digits_len;
+
+  /* why the program cannot run, for prog_error; empty if it can */
+  char error[64];
+
+  /* stack depths are known statically and never underflow */
+  bool static_depth;
+  size_t ncode_unoptimized;
+
+  /* dataflow graph from build_graph, for run_prog_batch; see below */
+  struct dc_node *nodes;
+  int nnodes;
+  int *results;                 /* nodes left on the stack, bottom first */
+  int nresults;                 /* values left; see also fuse_progs */
+  int *prf_operands;
+  ssize_t nprf_operands;
+  int nslots;
+  int result_bits;              /* low bits of the results used; 64 for all */
+  unsigned long id;             /* tells contexts' cached values apart */
+
+  /* remainders of polynomials; see run_differences */
+  bool polynomial;
+  int poly_degree;
+
+  /* native code from jit_compile, if any; see below */
+  word (*native)(word *stack, const word *args);
+  size_t native_len;
+
+  /* counts from run_prog_batch, if prog_profile was called */
+  struct dc_profile *profile;
+};
+
+/*
+ * Scratch space for running compiled programs.  A dc_prog is never
+ * changed once compiled, so any number of threads can share one, each
+ * running it in a context of its own.  The stacks grow to fit the
+ * deepest program run in the context.
+ */
+struct dc_ctx {
+  word *stack;
+  size_t stack_len;
+  struct batch_slot *batch_stack;       /* for run_prog_batch */
+  size_t batch_len;
+  struct node_plan *plan;
+  size_t plan_len;
+
+  /* the previous run_prog_batch call, and values kept from it */
+  unsigned long last_prog_id;
+  size_t last_n;
+  word *last_args;
+  size_t last_args_len;
+  word *cache;
+  size_t cache_len;
+  bool cache_filled;
+  unsigned long cache_uniform;  /* which arguments were uniform then */
+  unsigned long cache_stable;   /* and which unchanged */
+  int cache_bits;               /* and the width of the lanes */
+
+  word *diffs;                  /* for run_differences */
+  size_t diffs_len;
+  struct node_range *ranges;    /* for narrow_bits */
+  size_t ranges_len;
+
+  unsigned long grows;          /* times any of the above was enlarged */
+  struct dc_profile *profile;   /* the call in progress, if profiled */
+};
+
+/*
+ * Profiles, for dump -P: what run_prog_batch did for a program,
+ * summed over all calls in all contexts.  A call counts into a profile
+ * of its own, and adds that to the program's under profile_lock when
+ * it returns, so that threads do not contend while counting.
+ */
+struct dc_profile {
+  unsigned long calls;
+  unsigned long pixels;
+  unsigned long differenced;    /* by run_differences */
+  unsigned long interpreted;    /* by run_prog, one pixel at a time */
+  unsigned long narrowed[3];    /* in lanes of 32, 16 and 8 bits */
+  unsigned long ops[NUM_OPS];   /* values computed by each opcode */
+  unsigned long hashes;         /* of $ */
+  unsigned long hashed_words;   /* absorbed, past any shared prefix */
+  size_t max_hashed;
+  unsigned long grows;
+  uint64_t total_ns;
+  uint64_t prf_ns;
+};
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+profile_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+/* count hashes of $, of words words each, that took since start */
+static void
+profile_prf(struct dc_profile *prof, unsigned long hashes, size_t words,
+            uint64_t start)
+{
+  prof->prf_ns += profile_clock() - start;
+  prof->hashes += hashes;
+  prof->hashed_words += hashes * words;
+  if (words > prof->max_hashed)
+    prof->max_hashed = words;
+}
+
+static void optimize_prog(struct dc_prog *prog);
+static void build_graph(struct dc_prog *prog);
+static void finish_graph(struct dc_prog *prog);
+static void jit_compile(struct dc_prog *prog);
+static void find_demanded(struct dc_prog *prog);
+static void find_polynomial(struct dc_prog *prog);
+static bool run_differences(const struct dc_prog *prog, struct dc_ctx *ctx,
+                            const word *const args[], size_t n, word *out);
+struct node_plan;
+static int narrow_bits(const struct dc_prog *prog, struct dc_ctx *ctx,
+                       const struct node_plan *plan,
+                       const word *const args[], size_t n);
+
+/* stack effect of each opcode, for the passes over compiled programs */
+static const signed char op_pops[NUM_OPS] = {
+  [OP_END] = 1, [OP_ADD] = 2, [OP_SUB] = 2, [OP_MUL] = 2, [OP_DIV] = 2,
+  [OP_MOD] = 2, [OP_DIVMOD] = 2, [OP_NOT] = 1, [OP_OR] = 2, [OP_AND] = 2,
+  [OP_BOR] = 2, [OP_BAND] = 2, [OP_BXOR] = 2, [OP_SHL] = 2,
+  [OP_SHR] = 2, [OP_EQ] = 2, [OP_LT] = 2, [OP_LE] = 2, [OP_GT] = 2,
+  [OP_GE] = 2, [OP_DUP] = 1, [OP_SWAP] = 2, [OP_ROT] = 3, [OP_DROP] = 1,
+  [OP_SET_IBASE] = 1, [OP_PRF] = 1, [OP_STORE] = 1,
+  [OP_ADD_IMM] = 1, [OP_MUL_IMM] = 1, [OP_DIV_IMM] = 1, [OP_MOD_IMM] = 1,
+  [OP_BOR_IMM] = 1, [OP_BAND_IMM] = 1, [OP_BXOR_IMM] = 1, [OP_SHL_IMM] = 1,
+  [OP_SHR_IMM] = 1, [OP_DIV_POW2] = 1, [OP_MOD_POW2] = 1,
+};
+
+static const signed char op_pushes[NUM_OPS] = {
+  [OP_PUSH] = 1, [OP_PUSH_DIGITS] = 1, [OP_ADD] = 1, [OP_SUB] = 1, [OP_MUL] = 1, [OP_DIV] = 1,
+  [OP_MOD] = 1, [OP_DIVMOD] = 2, [OP_NOT] = 1, [OP_OR] = 1, [OP_AND] = 1,
+  [OP_BOR] = 1, [OP_BAND] = 1, [OP_BXOR] = 1, [OP_SHL] = 1,
+  [OP_SHR] = 1, [OP_EQ] = 1, [OP_LT] = 1, [OP_LE] = 1, [OP_GT] = 1,
+  [OP_GE] = 1, [OP_DUP] = 2, [OP_SWAP] = 2, [OP_ROT] = 3,
+  [OP_DEPTH] = 1, [OP_GET_IBASE] = 1, [OP_PRF] = 1, [OP_LOAD] = 1,
+  [OP_ADD_IMM] = 1, [OP_MUL_IMM] = 1, [OP_DIV_IMM] = 1, [OP_MOD_IMM] = 1,
+  [OP_BOR_IMM] = 1, [OP_BAND_IMM] = 1, [OP_BXOR_IMM] = 1, [OP_SHL_IMM] = 1,
+  [OP_SHR_IMM] = 1, [OP_DIV_POW2] = 1, [OP_MOD_POW2] = 1,
+};
+
+static const char *const op_names[NUM_OPS] = {
+  [OP_END] = "END", [OP_NOP] = "NOP", [OP_PUSH] = "PUSH",
+  [OP_PUSH_DIGITS] = "PUSH_DIGITS", [OP_ADD] = "ADD", [OP_SUB] = "SUB",
+  [OP_MUL] = "MUL", [OP_DIV] = "DIV", [OP_MOD] = "MOD",
+  [OP_DIVMOD] = "DIVMOD", [OP_NOT] = "NOT", [OP_OR] = "OR", [OP_AND] = "AND",
+  [OP_BOR] = "BOR", [OP_BAND] = "BAND", [OP_BXOR] = "BXOR", [OP_SHL] = "SHL",
+  [OP_SHR] = "SHR", [OP_EQ] = "EQ", [OP_LT] = "LT", [OP_LE] = "LE",
+  [OP_GT] = "GT", [OP_GE] = "GE", [OP_DUP] = "DUP", [OP_SWAP] = "SWAP",
+  [OP_ROT] = "ROT", [OP_DROP] = "DROP", [OP_CLEAR] = "CLEAR",
+  [OP_DEPTH] = "DEPTH", [OP_GET_IBASE] = "GET_IBASE",
+  [OP_SET_IBASE] = "SET_IBASE", [OP_PRF] = "PRF",
+  [OP_UNDERFLOW] = "UNDERFLOW", [OP_STORE] = "STORE", [OP_LOAD] = "LOAD",
+  [OP_ADD_IMM] = "ADD_IMM",
+  [OP_MUL_IMM] = "MUL_IMM", [OP_DIV_IMM] = "DIV_IMM",
+  [OP_MOD_IMM] = "MOD_IMM", [OP_BOR_IMM] = "BOR_IMM",
+  [OP_BAND_IMM] = "BAND_IMM", [OP_BXOR_IMM] = "BXOR_IMM",
+  [OP_SHL_IMM] = "SHL_IMM", [OP_SHR_IMM] = "SHR_IMM",
+  [OP_DIV_POW2] = "DIV_POW2", [OP_MOD_POW2] = "MOD_POW2", [OP_ARG] = "ARG",
+};
+
+/*
+ * Whether the depth of the stack before each instruction is the same
+ * on every run, and enough for it: true unless the program underflows
+ * or sets the input base from a computed value (compile_prog only
+ * tracks it after a literal in range).
+ */
+static bool
+check_static_depth(const struct dc_prog *prog)
+{
+  ssize_t depth = prog->nargs;
+
+  for (size_t pc = 0; pc < prog->ncode; pc++) {
+    const struct dc_insn *insn = &prog->code[pc];
+
+    switch (insn->op) {
+    case OP_PUSH_DIGITS:
+    case OP_UNDERFLOW:
+      return false;
+    case OP_SET_IBASE:
+      if (pc == 0 || prog->code[pc-1].op != OP_PUSH
+          || prog->code[pc-1].arg < 2 || prog->code[pc-1].arg > 16)
+        return false;
+      break;
+    case OP_CLEAR:
+      depth = 0;
+      continue;
+    }
+    if (depth < op_pops[insn->op])
+      return false;
+    depth += op_pushes[insn->op] - op_pops[insn->op];
+  }
+  return true;
+}
+
+static bool
+is_digit_char(int ch)
+{
+  return ('0' <= ch && ch <= '9') || ('A' <= ch && ch <= 'F') || ch == '_';
+}
+
+/* as readnumber(), for a number already split out of the text */
+static word
+parse_digits(const char *digits, word base)
+{
+  word n = 0, v;
+  bool sign = false;
+
+  for (; *digits != '\0'; digits++) {
+    if (*digits == '_') {
+      sign = true;
+      continue;
+    }
+    v = ('0' <= *digits && *digits <= '9') ? *digits - '0' : *digits - 'A' + 10;
+    __builtin_mul_overflow(n, base, &n);
+    __builtin_add_overflow(n, v, &n);
+  }
+  if (sign)
+    __builtin_mul_overflow(n, -1, &n);
+  return n;
+}
+
+static void
+emit(struct dc_prog *prog, size_t *cap, u_char op, word arg)
+{
+  if (prog->ncode == *cap) {
+    *cap = *cap * 2 + 8;
+    prog->code = reallocarray(prog->code, *cap, sizeof(*prog->code));
+    assert(prog->code != NULL);
+  }
+  prog->code[prog->ncode].op = op;
+  prog->code[prog->ncode].arg = arg;
+  prog->ncode++;
+}
+
+static unsigned long next_prog_id;
+
+/*
+ * Registers and macros are resolved while compiling.  Without control
+ * flow, which register each l reads, and whether it then holds a
+ * number or a macro, is known at that point in the text, so x compiles
+ * a macro in place as if its text were written there, and the bytecode
+ * never sees a string.  Numbers stored with s live in register slots
+ * past the stack; an l of a register never stored to pushes 0.
+ */
+struct compile_state {
+  struct dc_prog *prog;
+  const char *text;             /* the whole program, for positions */
+  size_t cap;
+  size_t digits_cap;
+
+  /* the input base, while it is known at compile time; 0 once not */
+  word ibase;
+
+  /*
+   * The depth of the stack does not depend on the values on it, so it
+   * is tracked here, and the first instruction that would underflow is
+   * compiled to OP_UNDERFLOW instead.  Every instruction that is
+   * reached then has the operands it needs, and none of the backends
+   * check for underflow.
+   */
+  ssize_t depth;
+
+  struct {
+    int slot;                   /* for a number; -1 until one is stored */
+    const char *macro;          /* the text, if it holds a macro now */
+    size_t macro_len;
+  } regs[UCHAR_MAX + 1];
+
+  /* the text of [ ], or of a macro loaded with l, awaiting s or x */
+  const char *string;
+  size_t string_len;
+  size_t string_pos;
+  int nesting;
+};
+
+/* instructions, with macros expanded, past which x gives up */
+#define MAX_EXPANDED 65536
+
+static void
+compile_text(struct compile_state *cs, const char *p, size_t len)
+{
+  struct dc_prog *prog = cs->prog;
+
+  for (size_t pos = 0; pos < len && prog->error[0] == '\0'; ) {
+    u_char ch = p[pos];
+    u_char op = op_table[ch];
+    size_t at = p + pos - cs->text + 1;         /* counting from 1 */
+
+    if (op == OP_NOP && ch != '[' && ch != 'x') {
+      pos++;
+      continue;
+    }
+    if (cs->string != NULL && ch != 's' && ch != 'x') {
+      snprintf(prog->error, sizeof(prog->error),
+               "string not followed by s or x (character %zu)",
+               cs->string_pos);
+      break;
+    }
+
+    if (op == OP_PUSH) {
+      size_t start = pos;
+      while (pos < len && is_digit_char(p[pos]))
+        pos++;
+
+      if (prog->digits_len + pos - start + 1 > cs->digits_cap) {
+        cs->digits_cap = (prog->digits_len + pos - start + 1) * 2;
+        prog->digits = realloc(prog->digits, cs->digits_cap);
+        assert(prog->digits != NULL);
+      }
+      char *digits = prog->digits + prog->digits_len;
+      memcpy(digits, p + start, pos - start);
+      digits[pos - start] = '\0';
+
+      if (cs->ibase != 0) {
+        emit(prog, &cs->cap, OP_PUSH, parse_digits(digits, cs->ibase));
+      } else {
+        emit(prog, &cs->cap, OP_PUSH_DIGITS, prog->digits_len);
+        prog->digits_len += pos - start + 1;
+      }
+      if (++cs->depth > prog->max_depth)
+        prog->max_depth = cs->depth;
+      continue;
+    }
+    pos++;
+
+    if (ch == '[') {
+      size_t start = pos;
+      int level = 1;
+      while (pos < len && level > 0)
+        if (p[pos++] == '[')
+          level++;
+        else if (p[pos-1] == ']')
+          level--;
+      if (level > 0) {
+        snprintf(prog->error, sizeof(prog->error),
+                 "unterminated string at '[' (character %zu)", at);
+        break;
+      }
+      cs->string = p + start;
+      cs->string_len = pos - 1 - start;
+      cs->string_pos = at;
+      continue;
+    }
+    if (ch == 'x' && cs->string != NULL) {
+      const char *macro = cs->string;
+      if (cs->nesting == MAX_NESTING) {
+        snprintf(prog->error, sizeof(prog->error),
+                 "macros nested too deeply at 'x' (character %zu)", at);
+        break;
+      }
+      if (prog->ncode > MAX_EXPANDED) {
+        snprintf(prog->error, sizeof(prog->error),
+                 "macros expand to over %d instructions", MAX_EXPANDED);
+        break;
+      }
+      cs->string = NULL;
+      cs->nesting++;
+      compile_text(cs, macro, cs->string_len);
+      cs->nesting--;
+      continue;
+    }
+    if ((ch == 's' || ch == 'l') && pos == len) {
+      snprintf(prog->error, sizeof(prog->error),
+               "no register after '%c' (character %zu)", ch, at);
+      break;
+    }
+    if (ch == 's' && cs->string != NULL) {
+      u_char reg = p[pos++];
+      cs->regs[reg].macro = cs->string;
+      cs->regs[reg].macro_len = cs->string_len;
+      cs->string = NULL;
+      continue;
+    }
+
+    if (cs->depth < op_pops[op] || (ch == 'x' && cs->depth < 1)) {
+      snprintf(prog->error, sizeof(prog->error),
+               "stack underflow at '%c' (character %zu)", ch, at);
+      break;
+    }
+
+    word arg = 0;
+    switch (op) {
+    case OP_NOP:
+      /* x of a number leaves it where it is */
+      continue;
+    case OP_SET_IBASE:
+      if (cs->ibase != 0 && prog->ncode > 0
+          && prog->code[prog->ncode-1].op == OP_PUSH
+          && prog->code[prog->ncode-1].arg >= 2
+          && prog->code[prog->ncode-1].arg <= 16)
+        cs->ibase = prog->code[prog->ncode-1].arg;
+      else
+        cs->ibase = 0;
+      break;
+    case OP_STORE: {
+      u_char reg = p[pos++];
+      if (cs->regs[reg].slot < 0)
+        cs->regs[reg].slot = prog->nregs++;
+      cs->regs[reg].macro = NULL;
+      arg = cs->regs[reg].slot;
+      break;
+    }
+    case OP_LOAD: {
+      u_char reg = p[pos++];
+      if (cs->regs[reg].macro != NULL) {
+        cs->string = cs->regs[reg].macro;
+        cs->string_len = cs->regs[reg].macro_len;
+        cs->string_pos = at;
+        continue;
+      }
+      if (cs->regs[reg].slot < 0)
+        op = OP_PUSH;
+      else
+        arg = cs->regs[reg].slot;
+      break;
+    }
+    }
+    emit(prog, &cs->cap, op, arg);
+    if (op == OP_CLEAR)
+      cs->depth = 0;
+    else
+      cs->depth += op_pushes[op] - op_pops[op];
+    if (cs->depth > prog->max_depth)
+      prog->max_depth = cs->depth;
+  }
+}
+
+struct dc_prog *
+compile_prog(const char *text, int nargs, int nresults)
+{
+  struct dc_prog *prog = calloc(1, sizeof(*prog));
+  assert(prog != NULL);
+  assert(nargs >= 0 && nresults >= 1);
+  prog->id = __atomic_add_fetch(&next_prog_id, 1, __ATOMIC_RELAXED);
+  prog->nargs = nargs;
+  prog->nresults = nresults;
+  prog->max_depth = nargs;
+
+  struct compile_state *cs = calloc(1, sizeof(*cs));
+  assert(cs != NULL);
+  cs->prog = prog;
+  cs->text = text;
+  cs->digits_cap = strlen(text) + 1;
+  prog->digits = malloc(cs->digits_cap);
+  assert(prog->digits != NULL);
+  cs->ibase = 10;
+  cs->depth = nargs;
+  for (int reg = 0; reg < nitems(cs->regs); reg++)
+    cs->regs[reg].slot = -1;
+
+  compile_text(cs, text, strlen(text));
+  if (prog->error[0] == '\0' && cs->string != NULL)
+    snprintf(prog->error, sizeof(prog->error),
+             "string not followed by s or x (character %zu)",
+             cs->string_pos);
+  if (prog->error[0] == '\0' && cs->depth < nresults)
+    snprintf(prog->error, sizeof(prog->error), (nresults == 1)
+             ? "stack underflow at end of program"
+             : "program leaves fewer than %d values", nresults);
+  if (prog->error[0] != '\0')
+    emit(prog, &cs->cap, OP_UNDERFLOW, 0);
+  emit(prog, &cs->cap, OP_END, 0);
+  free(cs);
+
+  prog->static_depth = check_static_depth(prog);
+  prog->ncode_unoptimized = prog->ncode;
+  if (prog->static_depth) {
+    optimize_prog(prog);
+    assert(check_static_depth(prog));
+    build_graph(prog);
+    find_polynomial(prog);
+  }
+  jit_compile(prog);
+  return prog;
+}
+
+/*
+ * Constant folding and peephole optimization, for programs with
+ * static_depth.  Instructions are appended to the output one at a
+ * time, and after each one the end of the output is rewritten for as
+ * long as some rule applies, so that folds cascade: "2 3 * 4 +"
+ * becomes one push.  A rule may only drop an instruction that cannot
+ * fail an assert, and may not change the stack that $ hashes, so every
+ * rewrite is local and keeps the depth of the stack the same.
+ */
+
+/* the value of a op b, as the interpreter computes it */
+static word
+fold_binary(u_char op, word b, word a)
+{
+  word r;
+
+  switch (op) {
+  case OP_ADD: case OP_ADD_IMM:
+    __builtin_add_overflow(b, a, &r);
+    return r;
+  case OP_SUB:
+    __builtin_sub_overflow(b, a, &r);
+    return r;
+  case OP_MUL: case OP_MUL_IMM:
+    __builtin_mul_overflow(b, a, &r);
+    return r;
+  case OP_DIV: case OP_DIV_IMM:
+    return b / a;
+  case OP_MOD: case OP_MOD_IMM:
+    return b % a;
+  case OP_OR:
+    return a || b;
+  case OP_AND:
+    return a && b;
+  case OP_BOR: case OP_BOR_IMM:
+    return b | a;
+  case OP_BAND: case OP_BAND_IMM:
+    return b & a;
+  case OP_BXOR: case OP_BXOR_IMM:
+    return b ^ a;
+  case OP_SHL: case OP_SHL_IMM:
+    return b << a;
+  case OP_SHR: case OP_SHR_IMM:
+    return b >> a;
+  case OP_DIV_POW2:
+    return b / ((word)1 << a);
+  case OP_MOD_POW2:
+    return b % ((word)1 << a);
+  case OP_EQ:
+    return a == b;
+  case OP_LT:
+    return a < b;
+  case OP_LE:
+    return a <= b;
+  case OP_GT:
+    return a > b;
+  case OP_GE:
+    return a >= b;
+  default:
+    assert(0);
+  }
+}
+
+/* the _IMM form of a binary opcode, or OP_NOP if there is none */
+static u_char
+imm_form(u_char op)
+{
+  switch (op) {
+  case OP_ADD:  return OP_ADD_IMM;
+  case OP_MUL:  return OP_MUL_IMM;
+  case OP_DIV:  return OP_DIV_IMM;
+  case OP_MOD:  return OP_MOD_IMM;
+  case OP_BOR:  return OP_BOR_IMM;
+  case OP_BAND: return OP_BAND_IMM;
+  case OP_BXOR: return OP_BXOR_IMM;
+  case OP_SHL:  return OP_SHL_IMM;
+  case OP_SHR:  return OP_SHR_IMM;
+  default:      return OP_NOP;
+  }
+}
+
+static bool
+is_imm_op(u_char op)
+{
+  return op >= OP_ADD_IMM && op <= OP_MOD_POW2;
+}
+
+/* whether op, with constant divisor or shift a, passes its asserts */
+static bool
+operand_ok(u_char op, word a)
+{
+  switch (op) {
+  case OP_DIV: case OP_MOD: case OP_DIVMOD:
+  case OP_DIV_IMM: case OP_MOD_IMM:
+    /* -1 is left alone too, since LONG_MIN / -1 traps */
+    return a != 0 && a != -1;
+  case OP_SHL: case OP_SHR:
+  case OP_SHL_IMM: case OP_SHR_IMM:
+    return a >= 0 && a <= 63;
+  default:
+    return true;
+  }
+}
+
+static int
+log2_exact(word a)
+{
+  if (a <= 0 || (a & (a - 1)) != 0)
+    return -1;
+  return __builtin_ctzl(a);
+}
+
+/*
+ * Division by a constant as a multiplication and shifts, after
+ * Granlund and Montgomery and Hacker's Delight, chapter 10: the
+ * quotient is the high half of magic * n, corrected and shifted, which
+ * costs a few cycles where a hardware division costs dozens.  The
+ * results are exactly those of C's / and %.
+ */
+
+struct sdiv {
+  word d;
+  word magic;
+  int shift;
+};
+
+/* d must not be 0, 1, -1 or LONG_MIN */
+static void
+sdiv_init(struct sdiv *div, word d)
+{
+  const uint64_t two63 = (uint64_t)1 << 63;
+  uint64_t ad = (d < 0) ? -(uint64_t)d : (uint64_t)d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+  uint64_t delta;
+  int p = 63;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  div->d = d;
+  div->magic = (word)(q2 + 1);
+  if (d < 0)
+    div->magic = (word)-(uint64_t)div->magic;
+  div->shift = p - 64;
+}
+
+static inline word
+sdiv_quot(const struct sdiv *div, word n)
+{
+  word q = (word)(((__int128)div->magic * n) >> 64);
+  if (div->d > 0 && div->magic < 0)
+    q = (word)((uint64_t)q + (uint64_t)n);
+  else if (div->d < 0 && div->magic > 0)
+    q = (word)((uint64_t)q - (uint64_t)n);
+  q >>= div->shift;
+  return q + (word)((uint64_t)q >> 63);
+}
+
+static inline word
+sdiv_rem(const struct sdiv *div, word n)
+{
+  return (word)((uint64_t)n - (uint64_t)sdiv_quot(div, n) * (uint64_t)div->d);
+}
+
+/* the same for unsigned n, as for the ranges of $; d must be at least 2 */
+struct udiv {
+  uint64_t d;
+  uint64_t magic;
+  int shift;
+  bool add;                     /* the magic number needs 65 bits */
+};
+
+static void
+udiv_init(struct udiv *div, uint64_t d)
+{
+  if ((d & (d - 1)) == 0) {
+    /* the shift alone, as udiv_rem computes ((n >> 1) + 0) >> (shift - 1) */
+    *div = (struct udiv){ d, 0, __builtin_ctzl(d), true };
+    return;
+  }
+
+  const uint64_t two63 = (uint64_t)1 << 63;
+  uint64_t nc = -1 - (-d) % d;
+  uint64_t q1 = two63 / nc, r1 = two63 - q1 * nc;
+  uint64_t q2 = (two63 - 1) / d, r2 = (two63 - 1) - q2 * d;
+  uint64_t delta;
+  bool add = false;
+  int p = 63;
+
+  do {
+    p++;
+    if (r1 >= nc - r1) {
+      q1 = 2 * q1 + 1;
+      r1 = 2 * r1 - nc;
+    } else {
+      q1 = 2 * q1;
+      r1 = 2 * r1;
+    }
+    if (r2 + 1 >= d - r2) {
+      if (q2 >= two63 - 1)
+        add = true;
+      q2 = 2 * q2 + 1;
+      r2 = 2 * r2 + 1 - d;
+    } else {
+      if (q2 >= two63)
+        add = true;
+      q2 = 2 * q2;
+      r2 = 2 * r2 + 1;
+    }
+    delta = d - 1 - r2;
+  } while (p < 128 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+  div->d = d;
+  div->magic = q2 + 1;
+  div->shift = p - 64;
+  div->add = add;
+}
+
+static inline uint64_t
+udiv_rem(const struct udiv *div, uint64_t n)
+{
+  uint64_t q = (uint64_t)(((unsigned __int128)div->magic * n) >> 64);
+  if (div->add)
+    q = (((n - q) >> 1) + q) >> (div->shift - 1);
+  else
+    q >>= div->shift;
+  return n - q * div->d;
+}
+
+/* rewrite the end of code[0..*n) once; true if anything changed */
+static bool
+peephole(struct dc_insn *code, size_t *n)
+{
+  struct dc_insn *last = &code[*n - 1];
+  struct dc_insn *prev = (*n >= 2) ? &code[*n - 2] : NULL;
+  struct dc_insn *prev2 = (*n >= 3) ? &code[*n - 3] : NULL;
+  u_char op = last->op;
+
+  /* c1 c2 op => c */
+  if (prev2 != NULL && prev2->op == OP_PUSH && prev->op == OP_PUSH
+      && op_pops[op] == 2 && op_pushes[op] == 1 && op != OP_SWAP
+      && operand_ok(op, prev->arg)) {
+    prev2->arg = fold_binary(op, prev2->arg, prev->arg);
+    *n -= 2;
+    return true;
+  }
+  if (prev2 != NULL && prev2->op == OP_PUSH && prev->op == OP_PUSH
+      && op == OP_DIVMOD && operand_ok(op, prev->arg)) {
+    word b = prev2->arg, a = prev->arg;
+    prev2->arg = b / a;
+    prev->arg = b % a;
+    *n -= 1;
+    return true;
+  }
+  if (prev != NULL && prev->op == OP_PUSH) {
+    switch (op) {
+    case OP_NOT:                /* c N => !c */
+      prev->arg = !prev->arg;
+      *n -= 1;
+      return true;
+    case OP_DUP:                /* c d => c c */
+      *last = *prev;
+      return true;
+    case OP_DROP:               /* c R => */
+    case OP_SET_IBASE:          /* ibase is tracked by optimize_prog */
+      *n -= 2;
+      return true;
+    }
+    /* c op => op_IMM c */
+    if (imm_form(op) != OP_NOP && operand_ok(op, prev->arg)) {
+      prev->op = imm_form(op);
+      *n -= 1;
+      return true;
+    }
+    if (op == OP_SUB) {         /* c - => +(-c), wrapping */
+      prev->op = OP_ADD_IMM;
+      prev->arg = (word)-(uint64_t)prev->arg;
+      *n -= 1;
+      return true;
+    }
+    /* c op_IMM => c' */
+    if (is_imm_op(op)) {
+      prev->arg = fold_binary(op, prev->arg, last->arg);
+      *n -= 1;
+      return true;
+    }
+  }
+  if (prev2 != NULL && prev2->op == OP_PUSH && prev->op == OP_PUSH
+      && op == OP_SWAP) {       /* c1 c2 r => c2 c1 */
+    word a = prev->arg;
+    prev->arg = prev2->arg;
+    prev2->arg = a;
+    *n -= 1;
+    return true;
+  }
+
+  /* stack-neutral sequences */
+  if (prev != NULL && op == OP_DROP
+      && (prev->op == OP_DUP || prev->op == OP_DEPTH
+          || prev->op == OP_GET_IBASE)) {
+    *n -= 2;
+    return true;
+  }
+  if (prev != NULL && op == OP_SWAP && prev->op == OP_SWAP) {
+    *n -= 2;
+    return true;
+  }
+  if (prev2 != NULL && op == OP_ROT && prev->op == OP_ROT
+      && prev2->op == OP_ROT) {
+    *n -= 3;
+    return true;
+  }
+  /* an op that cannot fail, then R => R */
+  if (prev != NULL && op == OP_DROP
+      && (prev->op == OP_NOT || is_imm_op(prev->op))) {
+    *prev = *last;
+    *n -= 1;
+    return true;
+  }
+
+  if (is_imm_op(op)) {
+    word c = last->arg;
+
+    /* identities */
+    if ((c == 0 && (op == OP_ADD_IMM || op == OP_BOR_IMM || op == OP_BXOR_IMM
+                    || op == OP_SHL_IMM || op == OP_SHR_IMM))
+        || (c == 1 && (op == OP_MUL_IMM || op == OP_DIV_IMM))
+        || (c == -1 && op == OP_BAND_IMM)) {
+      *n -= 1;
+      return true;
+    }
+
+    /* the sign of a remainder follows the dividend, not the divisor */
+    if (op == OP_MOD_IMM && c < 0 && c != LONG_MIN) {
+      last->arg = -c;
+      return true;
+    }
+
+    /* strength reduction by powers of two */
+    int k = log2_exact(c);
+    if (k > 0 && op == OP_MUL_IMM) {
+      last->op = OP_SHL_IMM;
+      last->arg = k;
+      return true;
+    }
+    if (k > 0 && op == OP_DIV_IMM) {
+      last->op = OP_DIV_POW2;
+      last->arg = k;
+      return true;
+    }
+    if (k > 0 && op == OP_MOD_IMM) {
+      last->op = OP_MOD_POW2;
+      last->arg = k;
+      return true;
+    }
+
+    /* two constant operations in a row */
+    if (prev != NULL && prev->op == op) {
+      switch (op) {
+      case OP_ADD_IMM:
+      case OP_MUL_IMM:
+      case OP_BOR_IMM:
+      case OP_BAND_IMM:
+      case OP_BXOR_IMM:
+        prev->arg = fold_binary(op, prev->arg, c);
+        *n -= 1;
+        return true;
+      case OP_SHL_IMM:
+        if (prev->arg + c <= 63) {
+          prev->arg += c;
+          *n -= 1;
+          return true;
+        }
+        break;
+      case OP_SHR_IMM:          /* arithmetic shifts saturate at 63 */
+        prev->arg = (prev->arg + c <= 63) ? prev->arg + c : 63;
+        *n -= 1;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static void
+optimize_prog(struct dc_prog *prog)
+{
+  struct dc_insn *out = calloc(prog->ncode, sizeof(*out));
+  /* registers known to hold a constant, stored from a push */
+  bool *known = calloc(prog->nregs + 1, sizeof(*known));
+  word *consts = calloc(prog->nregs + 1, sizeof(*consts));
+  assert(out != NULL && known != NULL && consts != NULL);
+  size_t n = 0;
+  ssize_t depth = prog->nargs;
+  word ibase = 10;
+
+  for (size_t pc = 0; pc < prog->ncode; pc++) {
+    struct dc_insn insn = prog->code[pc];
+
+    switch (insn.op) {
+    case OP_DEPTH:
+      insn.op = OP_PUSH;
+      insn.arg = depth;
+      break;
+    case OP_GET_IBASE:
+      insn.op = OP_PUSH;
+      insn.arg = ibase;
+      break;
+    case OP_SET_IBASE:
+      /* check_static_depth saw a literal in range just before */
+      ibase = prog->code[pc-1].arg;
+      break;
+    case OP_STORE:
+      known[insn.arg] = (n > 0 && out[n-1].op == OP_PUSH);
+      if (known[insn.arg]) {
+        consts[insn.arg] = out[n-1].arg;
+        n--;
+        depth--;
+        continue;
+      }
+      break;
+    case OP_LOAD:
+      if (known[insn.arg]) {
+        insn.op = OP_PUSH;
+        insn.arg = consts[insn.arg];
+      }
+      break;
+    }
+    if (insn.op == OP_CLEAR)
+      depth = 0;
+    else
+      depth += op_pushes[insn.op] - op_pops[insn.op];
+
+    out[n++] = insn;
+    if (insn.op != OP_END)
+      while (n > 0 && peephole(out, &n))
+        ;
+  }
+
+  free(known);
+  free(consts);
+  free(prog->code);
+  prog->code = out;
+  prog->ncode = n;
+}
+
+/* NULL if prog runs, or else why it fails, as it will on every input */
+const char *
+prog_error(const struct dc_prog *prog)
+{
+  return (prog->error[0] != '\0') ? prog->error : NULL;
+}
+
+void
+prog_insn_counts(const struct dc_prog *prog, size_t *before, size_t *after)
+{
+  /* not counting OP_END */
+  *before = prog->ncode_unoptimized - 1;
+  *after = prog->ncode - 1;
+}
+
+/*
+ * Only the low bits of prog's results will be used, so run_prog_batch
+ * need only get those right; the rest of each result is then
+ * undefined.
+ */
+void
+prog_result_bits(struct dc_prog *prog, int bits)
+{
+  assert(bits >= 1 && bits <= 64);
+  prog->result_bits = bits;
+  /* without a graph, the program runs a pixel at a time in full */
+  if (prog->nodes != NULL)
+    find_demanded(prog);
+}
+
+/* start counting what run_prog_batch does for prog */
+void
+prog_profile(struct dc_prog *prog)
+{
+  if (prog->profile == NULL) {
+    prog->profile = calloc(1, sizeof(*prog->profile));
+    assert(prog->profile != NULL);
+  }
+}
+
+static void
+add_profile(struct dc_profile *to, const struct dc_profile *from)
+{
+  pthread_mutex_lock(&profile_lock);
+  to->calls += from->calls;
+  to->pixels += from->pixels;
+  to->differenced += from->differenced;
+  to->interpreted += from->interpreted;
+  for (int k = 0; k < 3; k++)
+    to->narrowed[k] += from->narrowed[k];
+  for (int op = 0; op < NUM_OPS; op++)
+    to->ops[op] += from->ops[op];
+  to->hashes += from->hashes;
+  to->hashed_words += from->hashed_words;
+  if (from->max_hashed > to->max_hashed)
+    to->max_hashed = from->max_hashed;
+  to->grows += from->grows;
+  to->total_ns += from->total_ns;
+  to->prf_ns += from->prf_ns;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* summarize prog's profile on f, each line starting with name */
+void
+print_profile(FILE *f, const char *name, const struct dc_prog *prog)
+{
+  const struct dc_profile *prof = prog->profile;
+  if (prof == NULL)
+    return;
+
+  double total_ms = prof->total_ns / 1e6, prf_ms = prof->prf_ns / 1e6;
+  fprintf(f, "%s: %lu pixels in %lu calls, %.3f ms\n", name, prof->pixels,
+          prof->calls, total_ms);
+  fprintf(f, "%s:   %.3f ms in $, %.3f ms in everything else\n", name,
+          prf_ms, total_ms - prf_ms);
+  if (prof->hashes > 0)
+    fprintf(f, "%s:   %lu hashes, each absorbing %.1f words on average "
+            "and %zu at most\n",
+            name, prof->hashes, (double)prof->hashed_words / prof->hashes,
+            prof->max_hashed);
+  fprintf(f, "%s:   stack depth %zu, %lu buffers grown\n", name,
+          prog->max_depth, prof->grows);
+  if (prof->differenced > 0)
+    fprintf(f, "%s:   %lu pixels by finite differences\n", name,
+            prof->differenced);
+  if (prof->interpreted > 0)
+    fprintf(f, "%s:   %lu pixels interpreted\n", name, prof->interpreted);
+  for (int k = 0; k < 3; k++)
+    if (prof->narrowed[k] > 0)
+      fprintf(f, "%s:   %lu pixels in %d-bit lanes\n", name,
+              prof->narrowed[k], 32 >> k);
+
+  /* opcodes by the number of values computed, most first */
+  bool done[NUM_OPS] = { false };
+  for (;;) {
+    int most = -1;
+    for (int op = 0; op < NUM_OPS; op++)
+      if (!done[op] && prof->ops[op] > 0
+          && (most < 0 || prof->ops[op] > prof->ops[most]))
+        most = op;
+    if (most < 0)
+      break;
+    fprintf(f, "%s:   %-12s %lu\n", name, op_names[most], prof->ops[most]);
+    done[most] = true;
+  }
+}
+
+void
+free_prog(struct dc_prog *prog)
+{
+  if (prog->native != NULL)
+    munmap(prog->native, prog->native_len);
+  free(prog->code);
+  free(prog->digits);
+  free(prog->nodes);
+  free(prog->results);
+  free(prog->prf_operands);
+  free(prog->profile);
+  free(prog);
+}
+
+struct dc_ctx *
+new_ctx(void)
+{
+  struct dc_ctx *ctx = calloc(1, sizeof(*ctx));
+  assert(ctx != NULL);
+  return ctx;
+}
+
+void
+free_ctx(struct dc_ctx *ctx)
+{
+  free(ctx->stack);
+  free(ctx->batch_stack);
+  free(ctx->plan);
+  free(ctx->last_args);
+  free(ctx->cache);
+  free(ctx->diffs);
+  free(ctx->ranges);
+  free(ctx);
+}
+
+/* the context's stack, with room for at least len words */
+static word *
+ctx_words(struct dc_ctx *ctx, size_t len)
+{
+  if (ctx->stack_len < len) {
+    ctx->grows++;
+    free(ctx->stack);
+    ctx->stack_len = len;
+    ctx->stack = calloc(ctx->stack_len, sizeof(*ctx->stack));
+    assert(ctx->stack != NULL);
+  }
+  return ctx->stack;
+}
+
+/*
+ * A stack with room for prog, including the hash input of $, followed
+ * by its registers.
+ */
+static word *
+ctx_stack(struct dc_ctx *ctx, const struct dc_prog *prog)
+{
+  return ctx_words(ctx, prog->max_depth + 1 + prog->nregs);
+}
+
+/*
+ * x86-64 JIT.  With no control flow in the language, the stack depth
+ * before each instruction is known at compile time, so every stack
+ * slot has a fixed home: the bottom JIT_SLOT_REGS slots live in
+ * callee-saved registers, and the rest in the context's stack,
+ * addressed off rbx.  The generated function is
+ *
+ *   word native(word *stack, const word *args);
+ *
+ * Programs the JIT does not handle -- those that underflow, or whose
+ * input base is only known at run time -- are left to the
+ * interpreter, which reports the failure or does the parsing exactly
+ * as eval() would.  Build with -DMINIDC_NO_JIT to always interpret.
+ */
+
+#if defined(__x86_64__) && !defined(MINIDC_NO_JIT)
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define JIT_SLOT_REGS 5
+static const u_char slot_regs[JIT_SLOT_REGS] = { RBP, R12, R13, R14, R15 };
+
+/* failed asserts in generated code; the messages match the interpreter */
+enum { JIT_FAIL_DIV, JIT_FAIL_SHIFT };
+
+static void
+jit_fail(int reason)
+{
+  static const char *const messages[] = {
+    [JIT_FAIL_DIV] = "a != 0",
+    [JIT_FAIL_SHIFT] = "shiftby >= 0 && shiftby <= 63",
+  };
+  fprintf(stderr, "minidc: assertion `%s' failed in compiled program.\n",
+          messages[reason]);
+  abort();
+}
+
+static word
+jit_prf(word *stack, size_t depth, word range)
+{
+  assert(range > 0);
+
+  uint64_t prf_out = prf_hash(stack, depth);
+  return (word)(prf_out % (uint64_t)range);
+}
+
+struct jit_buf {
+  u_char *code;
+  size_t len;
+  size_t cap;
+};
+
+static void
+jb(struct jit_buf *j, u_char byte)
+{
+  assert(j->len < j->cap);
+  j->code[j->len++] = byte;
+}
+
+static void
+jb32(struct jit_buf *j, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    jb(j, v >> (8*i));
+}
+
+static void
+jb64(struct jit_buf *j, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    jb(j, v >> (8*i));
+}
+
+/* REX.W op reg, r/m with a register r/m */
+static void
+emit_rr(struct jit_buf *j, u_char opcode, int reg, int rm)
+{
+  jb(j, 0x48 | (reg >> 3) << 2 | (rm >> 3));
+  jb(j, opcode);
+  jb(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* REX.W op reg, [rbx + disp32] */
+static void
+emit_rm(struct jit_buf *j, u_char opcode, int reg, int32_t disp)
+{
+  jb(j, 0x48 | (reg >> 3) << 2);
+  jb(j, opcode);
+  jb(j, 0x80 | (reg & 7) << 3 | RBX);
+  jb32(j, disp);
+}
+
+static void
+emit_mov_imm(struct jit_buf *j, int reg, word imm)
+{
+  if (imm == (int32_t)imm) {
+    jb(j, 0x48 | (reg >> 3));           /* mov r/m64, imm32 */
+    jb(j, 0xc7);
+    jb(j, 0xc0 | (reg & 7));
+    jb32(j, imm);
+  } else {
+    jb(j, 0x48 | (reg >> 3));           /* movabs r64, imm64 */
+    jb(j, 0xb8 | (reg & 7));
+    jb64(j, imm);
+  }
+}
+
+static void
+load_slot(struct jit_buf *j, int reg, size_t slot)
+{
+  if (slot < JIT_SLOT_REGS)
+    emit_rr(j, 0x8b, reg, slot_regs[slot]);
+  else
+    emit_rm(j, 0x8b, reg, slot * sizeof(word));
+}
+
+static void
+store_slot(struct jit_buf *j, size_t slot, int reg)
+{
+  if (slot < JIT_SLOT_REGS)
+    emit_rr(j, 0x8b, slot_regs[slot], reg);
+  else
+    emit_rm(j, 0x89, reg, slot * sizeof(word));
+}
+
+/* call fn, which the System V ABI lets clobber rax..r11 */
+static void
+emit_call(struct jit_buf *j, void *fn)
+{
+  emit_mov_imm(j, RAX, (word)fn);
+  jb(j, 0xff); jb(j, 0xd0);             /* call rax */
+}
+
+/* if the flags say jcc, call jit_fail(reason) */
+static void
+emit_fail_if(struct jit_buf *j, u_char jcc, int reason)
+{
+  jb(j, 0x70 | (jcc ^ 1));              /* jncc over the call */
+  size_t patch = j->len;
+  jb(j, 0);
+  jb(j, 0xbf); jb32(j, reason);         /* mov edi, reason */
+  emit_call(j, jit_fail);
+  j->code[patch] = j->len - patch - 1;
+}
+
+/* rax = (flags say cc) */
+static void
+emit_setcc(struct jit_buf *j, u_char cc)
+{
+  jb(j, 0x0f); jb(j, 0x90 | cc); jb(j, 0xc0);   /* setcc al */
+  jb(j, 0x0f); jb(j, 0xb6); jb(j, 0xc0);        /* movzx eax, al */
+}
+
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
+static const u_char callee_saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+static void
+jit_compile(struct dc_prog *prog)
+{
+  if (!prog->static_depth || prog->nresults > 1)
+    return;
+
+  size_t cap = 128 + prog->nargs * 16 + prog->ncode * 96;
+  void *mem = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return;
+  struct jit_buf j = { mem, 0, cap };
+
+  /* prologue: six pushes and the return address, plus 8, keep rsp aligned */
+  for (int r = 0; r < nitems(callee_saved); r++) {
+    if (callee_saved[r] >= R8)
+      jb(&j, 0x41);
+    jb(&j, 0x50 | (callee_saved[r] & 7));
+  }
+  jb(&j, 0x48); jb(&j, 0x83); jb(&j, 0xec); jb(&j, 8);     /* sub rsp, 8 */
+  emit_rr(&j, 0x8b, RBX, RDI);                              /* mov rbx, rdi */
+  for (int i = 0; i < prog->nargs; i++) {
+    jb(&j, 0x48); jb(&j, 0x8b); jb(&j, 0x86); jb32(&j, i * sizeof(word));
+    store_slot(&j, i, RAX);             /* via mov rax, [rsi + 8i] */
+  }
+
+  word ibase = 10;
+  ssize_t depth = prog->nargs;
+  for (size_t pc = 0; pc < prog->ncode; pc++) {
+    const struct dc_insn *insn = &prog->code[pc];
+    size_t top = depth - 1;
+
+    switch (insn->op) {
+    case OP_NOP:
+      break;
+    case OP_PUSH:
+      emit_mov_imm(&j, RAX, insn->arg);
+      store_slot(&j, depth++, RAX);
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_BOR:
+    case OP_BAND:
+    case OP_BXOR: {
+      static const u_char opcodes[NUM_OPS] = {
+        [OP_ADD] = 0x01, [OP_SUB] = 0x29, [OP_BOR] = 0x09,
+        [OP_BAND] = 0x21, [OP_BXOR] = 0x31,
+      };
+      load_slot(&j, RAX, top - 1);
+      load_slot(&j, RCX, top);
+      emit_rr(&j, opcodes[insn->op], RCX, RAX);     /* op rax, rcx */
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    }
+    case OP_MUL:
+      load_slot(&j, RAX, top - 1);
+      load_slot(&j, RCX, top);
+      jb(&j, 0x48); jb(&j, 0x0f); jb(&j, 0xaf); jb(&j, 0xc1);  /* imul rax, rcx */
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    case OP_DIV:
+    case OP_MOD:
+    case OP_DIVMOD:
+      load_slot(&j, RAX, top - 1);
+      load_slot(&j, RCX, top);
+      emit_rr(&j, 0x85, RCX, RCX);                  /* test rcx, rcx */
+      emit_fail_if(&j, CC_E, JIT_FAIL_DIV);
+      jb(&j, 0x48); jb(&j, 0x99);                   /* cqo */
+      jb(&j, 0x48); jb(&j, 0xf7); jb(&j, 0xf9);     /* idiv rcx */
+      if (insn->op == OP_DIVMOD) {
+        store_slot(&j, top - 1, RAX);
+        store_slot(&j, top, RDX);
+      } else {
+        store_slot(&j, top - 1, insn->op == OP_DIV ? RAX : RDX);
+        depth--;
+      }
+      break;
+    case OP_SHL:
+    case OP_SHR:
+      load_slot(&j, RAX, top - 1);
+      load_slot(&j, RCX, top);
+      jb(&j, 0x48); jb(&j, 0x83); jb(&j, 0xf9); jb(&j, 63);   /* cmp rcx, 63 */
+      emit_fail_if(&j, CC_A, JIT_FAIL_SHIFT);
+      jb(&j, 0x48); jb(&j, 0xd3);
+      jb(&j, insn->op == OP_SHL ? 0xe0 : 0xf8);     /* shl/sar rax, cl */
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    case OP_NOT:
+      load_slot(&j, RCX, top);
+      emit_rr(&j, 0x85, RCX, RCX);
+      emit_setcc(&j, CC_E);
+      store_slot(&j, top, RAX);
+      break;
+    case OP_OR:
+      load_slot(&j, RCX, top - 1);
+      load_slot(&j, RDX, top);
+      emit_rr(&j, 0x09, RDX, RCX);                  /* or rcx, rdx */
+      emit_setcc(&j, CC_NE);
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    case OP_AND:
+      load_slot(&j, RCX, top - 1);
+      load_slot(&j, RDX, top);
+      emit_rr(&j, 0x85, RCX, RCX);
+      jb(&j, 0x0f); jb(&j, 0x95); jb(&j, 0xc1);     /* setne cl */
+      emit_rr(&j, 0x85, RDX, RDX);
+      emit_setcc(&j, CC_NE);
+      jb(&j, 0x21); jb(&j, 0xc8);                   /* and eax, ecx */
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE: {
+      static const u_char conds[NUM_OPS] = {
+        [OP_EQ] = CC_E, [OP_LT] = CC_L, [OP_LE] = CC_LE,
+        [OP_GT] = CC_G, [OP_GE] = CC_GE,
+      };
+      /* the popped top is compared against the value below it */
+      load_slot(&j, RCX, top);
+      load_slot(&j, RDX, top - 1);
+      emit_rr(&j, 0x39, RDX, RCX);                  /* cmp rcx, rdx */
+      emit_setcc(&j, conds[insn->op]);
+      store_slot(&j, top - 1, RAX);
+      depth--;
+      break;
+    }
+    case OP_DUP:
+      load_slot(&j, RAX, top);
+      store_slot(&j, depth++, RAX);
+      break;
+    case OP_SWAP:
+      load_slot(&j, RAX, top);
+      load_slot(&j, RCX, top - 1);
+      store_slot(&j, top, RCX);
+      store_slot(&j, top - 1, RAX);
+      break;
+    case OP_ROT:
+      load_slot(&j, RAX, top - 2);
+      load_slot(&j, RCX, top - 1);
+      store_slot(&j, top - 2, RCX);
+      load_slot(&j, RCX, top);
+      store_slot(&j, top - 1, RCX);
+      store_slot(&j, top, RAX);
+      break;
+    case OP_DROP:
+      depth--;
+      break;
+    case OP_CLEAR:
+      depth = 0;
+      break;
+    case OP_STORE:
+      load_slot(&j, RAX, top);
+      store_slot(&j, prog->max_depth + 1 + insn->arg, RAX);
+      depth--;
+      break;
+    case OP_LOAD:
+      load_slot(&j, RAX, prog->max_depth + 1 + insn->arg);
+      store_slot(&j, depth++, RAX);
+      break;
+    case OP_DEPTH:
+      emit_mov_imm(&j, RAX, depth);
+      store_slot(&j, depth++, RAX);
+      break;
+    case OP_GET_IBASE:
+      emit_mov_imm(&j, RAX, ibase);
+      store_slot(&j, depth++, RAX);
+      break;
+    case OP_SET_IBASE:
+      ibase = prog->code[pc-1].arg;
+      depth--;
+      break;
+    case OP_PRF:
+      /* the hash covers the whole stack, so it all has to be in memory */
+      for (size_t slot = 0; slot < top && slot < JIT_SLOT_REGS; slot++)
+        emit_rm(&j, 0x89, slot_regs[slot], slot * sizeof(word));
+      load_slot(&j, RDX, top);
+      emit_rr(&j, 0x8b, RDI, RBX);                  /* mov rdi, rbx */
+      emit_mov_imm(&j, RSI, top);
+      emit_call(&j, jit_prf);
+      store_slot(&j, top, RAX);
+      break;
+    case OP_ADD_IMM:
+    case OP_BOR_IMM:
+    case OP_BAND_IMM:
+    case OP_BXOR_IMM: {
+      static const u_char opcodes[NUM_OPS] = {
+        [OP_ADD_IMM] = 0x01, [OP_BOR_IMM] = 0x09,
+        [OP_BAND_IMM] = 0x21, [OP_BXOR_IMM] = 0x31,
+      };
+      load_slot(&j, RAX, top);
+      emit_mov_imm(&j, RCX, insn->arg);
+      emit_rr(&j, opcodes[insn->op], RCX, RAX);     /* op rax, rcx */
+      store_slot(&j, top, RAX);
+      break;
+    }
+    case OP_MUL_IMM:
+      load_slot(&j, RAX, top);
+      emit_mov_imm(&j, RCX, insn->arg);
+      jb(&j, 0x48); jb(&j, 0x0f); jb(&j, 0xaf); jb(&j, 0xc1);  /* imul rax, rcx */
+      store_slot(&j, top, RAX);
+      break;
+    case OP_DIV_IMM:
+    case OP_MOD_IMM:
+      if (insn->arg != 1 && insn->arg != LONG_MIN) {
+        /* multiply by the reciprocal, as sdiv_quot and sdiv_rem do */
+        struct sdiv div;
+        sdiv_init(&div, insn->arg);
+        load_slot(&j, RCX, top);
+        emit_mov_imm(&j, RAX, div.magic);
+        jb(&j, 0x48); jb(&j, 0xf7); jb(&j, 0xe9);   /* imul rcx */
+        if (div.d > 0 && div.magic < 0)
+          emit_rr(&j, 0x01, RCX, RDX);              /* add rdx, rcx */
+        else if (div.d < 0 && div.magic > 0)
+          emit_rr(&j, 0x29, RCX, RDX);              /* sub rdx, rcx */
+        if (div.shift > 0) {                        /* sar rdx, shift */
+          jb(&j, 0x48); jb(&j, 0xc1); jb(&j, 0xfa); jb(&j, div.shift);
+        }
+        emit_rr(&j, 0x8b, RAX, RDX);                /* mov rax, rdx */
+        jb(&j, 0x48); jb(&j, 0xc1); jb(&j, 0xe8); jb(&j, 63); /* shr rax, 63 */
+        emit_rr(&j, 0x01, RAX, RDX);                /* add rdx, rax */
+        if (insn->op == OP_MOD_IMM) {
+          emit_mov_imm(&j, RAX, insn->arg);
+          /* imul rax, rdx */
+          jb(&j, 0x48); jb(&j, 0x0f); jb(&j, 0xaf); jb(&j, 0xc2);
+          emit_rr(&j, 0x29, RAX, RCX);              /* sub rcx, rax */
+          store_slot(&j, top, RCX);
+        } else {
+          store_slot(&j, top, RDX);
+        }
+        break;
+      }
+      load_slot(&j, RAX, top);
+      emit_mov_imm(&j, RCX, insn->arg);
+      jb(&j, 0x48); jb(&j, 0x99);                   /* cqo */
+      jb(&j, 0x48); jb(&j, 0xf7); jb(&j, 0xf9);     /* idiv rcx */
+      store_slot(&j, top, insn->op == OP_DIV_IMM ? RAX : RDX);
+      break;
+    case OP_SHL_IMM:
+    case OP_SHR_IMM:
+      load_slot(&j, RAX, top);
+      jb(&j, 0x48); jb(&j, 0xc1);
+      jb(&j, insn->op == OP_SHL_IMM ? 0xe0 : 0xf8); /* shl/sar rax, imm8 */
+      jb(&j, insn->arg);
+      store_slot(&j, top, RAX);
+      break;
+    case OP_DIV_POW2:
+    case OP_MOD_POW2:
+      /* bias negative values by the mask so that they round towards 0 */
+      load_slot(&j, RAX, top);
+      emit_rr(&j, 0x8b, RDX, RAX);                  /* mov rdx, rax */
+      jb(&j, 0x48); jb(&j, 0xc1); jb(&j, 0xfa); jb(&j, 63);   /* sar rdx, 63 */
+      emit_mov_imm(&j, RCX, ((word)1 << insn->arg) - 1);
+      emit_rr(&j, 0x21, RCX, RDX);                  /* and rdx, rcx */
+      emit_rr(&j, 0x01, RDX, RAX);                  /* add rax, rdx */
+      if (insn->op == OP_DIV_POW2) {
+        jb(&j, 0x48); jb(&j, 0xc1); jb(&j, 0xf8); jb(&j, insn->arg);
+      } else {
+        emit_rr(&j, 0x21, RCX, RAX);                /* and rax, rcx */
+        emit_rr(&j, 0x29, RDX, RAX);                /* sub rax, rdx */
+      }
+      store_slot(&j, top, RAX);
+      break;
+    case OP_END:
+      load_slot(&j, RAX, top);
+      break;
+    default:
+      assert(0);
+    }
+  }
+
+  /* epilogue */
+  jb(&j, 0x48); jb(&j, 0x83); jb(&j, 0xc4); jb(&j, 8);     /* add rsp, 8 */
+  for (int r = nitems(callee_saved) - 1; r >= 0; r--) {
+    if (callee_saved[r] >= R8)
+      jb(&j, 0x41);
+    jb(&j, 0x58 | (callee_saved[r] & 7));
+  }
+  jb(&j, 0xc3);
+
+  int rv = mprotect(mem, cap, PROT_READ | PROT_EXEC);
+  assert(rv == 0);
+  prog->native = (word (*)(word *, const word *))mem;
+  prog->native_len = cap;
+}
+
+#else
+
+static void
+jit_compile(struct dc_prog *prog)
+{
+}
+
+#endif
+
+word
+run_prog(const struct dc_prog *prog, struct dc_ctx *ctx, const word *args,
+         int nargs)
+{
+  static void *const dispatch[NUM_OPS] = {
+    [OP_END] = &&op_end,         [OP_NOP] = &&op_nop,
+    [OP_PUSH] = &&op_push,       [OP_PUSH_DIGITS] = &&op_push_digits,
+    [OP_ADD] = &&op_add,         [OP_SUB] = &&op_sub,
+    [OP_MUL] = &&op_mul,         [OP_DIV] = &&op_div,
+    [OP_MOD] = &&op_mod,         [OP_DIVMOD] = &&op_divmod,
+    [OP_NOT] = &&op_not,         [OP_OR] = &&op_or,
+    [OP_AND] = &&op_and,         [OP_BOR] = &&op_bor,
+    [OP_BAND] = &&op_band,       [OP_BXOR] = &&op_bxor,
+    [OP_SHL] = &&op_shl,         [OP_SHR] = &&op_shr,
+    [OP_EQ] = &&op_eq,           [OP_LT] = &&op_lt,
+    [OP_LE] = &&op_le,           [OP_GT] = &&op_gt,
+    [OP_GE] = &&op_ge,           [OP_DUP] = &&op_dup,
+    [OP_SWAP] = &&op_swap,       [OP_ROT] = &&op_rot,
+    [OP_DROP] = &&op_drop,       [OP_CLEAR] = &&op_clear,
+    [OP_DEPTH] = &&op_depth,     [OP_GET_IBASE] = &&op_get_ibase,
+    [OP_SET_IBASE] = &&op_set_ibase, [OP_PRF] = &&op_prf,
+    [OP_UNDERFLOW] = &&op_underflow,
+    [OP_STORE] = &&op_store,     [OP_LOAD] = &&op_load,
+    [OP_ADD_IMM] = &&op_add_imm, [OP_MUL_IMM] = &&op_mul_imm,
+    [OP_DIV_IMM] = &&op_div_imm, [OP_MOD_IMM] = &&op_mod_imm,
+    [OP_BOR_IMM] = &&op_bor_imm, [OP_BAND_IMM] = &&op_band_imm,
+    [OP_BXOR_IMM] = &&op_bxor_imm, [OP_SHL_IMM] = &&op_shl_imm,
+    [OP_SHR_IMM] = &&op_shr_imm, [OP_DIV_POW2] = &&op_div_pow2,
+    [OP_MOD_POW2] = &&op_mod_pow2,
+  };
+
+  const struct dc_insn *ip = prog->code;
+  word *stack = ctx_stack(ctx, prog);
+  word *regs = stack + prog->max_depth + 1;
+  ssize_t sp = -1;
+  word ibase = 10;
+  word a;
+
+  assert(nargs == prog->nargs);
+  assert(prog->code != NULL);   /* fused programs only run in batches */
+  if (prog->native != NULL)
+    return prog->native(stack, args);
+
+  for (int i = 0; i < nargs; i++)
+    stack[++sp] = args[i];
+
+/* operands are popped off the top; compile_prog saw that they are there */
+#define NEXT     goto *dispatch[(++ip)->op]
+
+  goto *dispatch[ip->op];
+
+op_nop:
+  NEXT;
+op_push:
+  stack[++sp] = ip->arg;
+  NEXT;
+op_push_digits:
+  stack[++sp] = parse_digits(prog->digits + ip->arg, ibase);
+  NEXT;
+op_add:
+  a = stack[sp--];
+  __builtin_add_overflow(stack[sp], a, &stack[sp]);
+  NEXT;
+op_sub:
+  a = stack[sp--];
+  __builtin_sub_overflow(stack[sp], a, &stack[sp]);
+  NEXT;
+op_mul:
+  a = stack[sp--];
+  __builtin_mul_overflow(stack[sp], a, &stack[sp]);
+  NEXT;
+op_div:
+  a = stack[sp--];
+  assert(a != 0);
+  stack[sp] = stack[sp] / a;
+  NEXT;
+op_mod:
+  a = stack[sp--];
+  assert(a != 0);
+  stack[sp] = stack[sp] % a;
+  NEXT;
+op_divmod:
+  a = stack[sp];
+  assert(a != 0);
+  stack[sp] = stack[sp-1] % a;
+  stack[sp-1] = stack[sp-1] / a;
+  NEXT;
+op_not:
+  stack[sp] = !stack[sp];
+  NEXT;
+op_or:
+  a = stack[sp--];
+  stack[sp] = a || stack[sp];
+  NEXT;
+op_and:
+  a = stack[sp--];
+  stack[sp] = a && stack[sp];
+  NEXT;
+op_bor:
+  a = stack[sp--];
+  stack[sp] |= a;
+  NEXT;
+op_band:
+  a = stack[sp--];
+  stack[sp] &= a;
+  NEXT;
+op_bxor:
+  a = stack[sp--];
+  stack[sp] ^= a;
+  NEXT;
+op_shl:
+  a = stack[sp--];
+  assert(a >= 0 && a <= 63);
+  stack[sp] = stack[sp] << a;
+  NEXT;
+op_shr:
+  a = stack[sp--];
+  assert(a >= 0 && a <= 63);
+  stack[sp] = stack[sp] >> a;
+  NEXT;
+  /* comparisons compare the popped top against the value below it */
+op_eq:
+  a = stack[sp--];
+  stack[sp] = a == stack[sp];
+  NEXT;
+op_lt:
+  a = stack[sp--];
+  stack[sp] = a < stack[sp];
+  NEXT;
+op_le:
+  a = stack[sp--];
+  stack[sp] = a <= stack[sp];
+  NEXT;
+op_gt:
+  a = stack[sp--];
+  stack[sp] = a > stack[sp];
+  NEXT;
+op_ge:
+  a = stack[sp--];
+  stack[sp] = a >= stack[sp];
+  NEXT;
+op_dup:
+  stack[sp+1] = stack[sp];
+  sp++;
+  NEXT;
+op_swap:
+  a = stack[sp]; stack[sp] = stack[sp-1]; stack[sp-1] = a;
+  NEXT;
+op_rot:
+  a = stack[sp-2]; stack[sp-2] = stack[sp-1]; stack[sp-1] = stack[sp];
+  stack[sp] = a;
+  NEXT;
+op_drop:
+  sp--;
+  NEXT;
+op_store:
+  regs[ip->arg] = stack[sp--];
+  NEXT;
+op_load:
+  stack[++sp] = regs[ip->arg];
+  NEXT;
+op_clear:
+  sp = -1;
+  NEXT;
+op_depth:
+  stack[sp+1] = sp + 1;
+  sp++;
+  NEXT;
+op_get_ibase:
+  stack[++sp] = ibase;
+  NEXT;
+op_set_ibase:
+  a = stack[sp--];
+  assert(a >= 2 && a <= 16);
+  ibase = a;
+  NEXT;
+op_prf:
+  a = stack[sp--];
+  assert(a > 0);
+  {
+    uint64_t start = (ctx->profile != NULL) ? profile_clock() : 0;
+    uint64_t prf_out = prf_hash(stack, sp + 1);
+    if (ctx->profile != NULL)
+      profile_prf(ctx->profile, 1, sp + 1, start);
+    stack[++sp] = (word)(prf_out % (uint64_t)a);
+  }
+  NEXT;
+  /* the optimizer only emits these where their asserts cannot fail */
+op_add_imm:
+  __builtin_add_overflow(stack[sp], ip->arg, &stack[sp]);
+  NEXT;
+op_mul_imm:
+  __builtin_mul_overflow(stack[sp], ip->arg, &stack[sp]);
+  NEXT;
+op_div_imm:
+  stack[sp] = stack[sp] / ip->arg;
+  NEXT;
+op_mod_imm:
+  stack[sp] = stack[sp] % ip->arg;
+  NEXT;
+op_bor_imm:
+  stack[sp] |= ip->arg;
+  NEXT;
+op_band_imm:
+  stack[sp] &= ip->arg;
+  NEXT;
+op_bxor_imm:
+  stack[sp] ^= ip->arg;
+  NEXT;
+op_shl_imm:
+  stack[sp] = stack[sp] << ip->arg;
+  NEXT;
+op_shr_imm:
+  stack[sp] = stack[sp] >> ip->arg;
+  NEXT;
+op_div_pow2:
+  a = (stack[sp] >> 63) & (((word)1 << ip->arg) - 1);
+  stack[sp] = (stack[sp] + a) >> ip->arg;
+  NEXT;
+op_mod_pow2:
+  a = (stack[sp] >> 63) & (((word)1 << ip->arg) - 1);
+  stack[sp] = ((stack[sp] + a) & (((word)1 << ip->arg) - 1)) - a;
+  NEXT;
+op_underflow:
+  fprintf(stderr, "minidc: %s.\n", prog->error);
+  abort();
+op_end:
+  /* further results go to the bottom of the stack, for run_prog_batch */
+  if (prog->nresults > 1)
+    memmove(stack, stack + sp + 1 - prog->nresults,
+            prog->nresults * sizeof(word));
+  return stack[sp];
+
+#undef NEXT
+}
+
+/*
+ * Batch evaluation: run a program over many pixels at once, with each
+ * value held as a vector of BATCH_LANES values, one per pixel.  Each
+ * operation is then a loop over the lanes, written with GCC vector
+ * types so that it compiles to AVX2 where the CPU has it, and to
+ * whatever vectors the target has elsewhere.  This needs the stack to
+ * have the same shape in every lane, which is what static_depth
+ * guarantees; other programs run one pixel at a time.
+ *
+ * Such a program is first turned into a dataflow graph, with one node
+ * per value computed and the stack shuffles resolved away, so that
+ * each node can be evaluated as often as its inputs change rather than
+ * once per pixel.  A node whose inputs are the same in every lane of a
+ * call -- in dump, anything computed from chan and row alone -- is
+ * computed once per call, as a scalar.  A node whose inputs are the
+ * same as in the context's previous call of the program -- anything
+ * computed from col alone -- is computed once and then read back from
+ * the context on later calls.  Only the rest is computed per pixel.
+ *
+ * Arithmetic is done on unsigned lanes where it must wrap, as with the
+ * __builtin_*_overflow calls of the interpreter.  An assert that fails
+ * in any lane fails for the whole batch, as it would have when that
+ * lane's pixel was reached.
+ */
+
+#define BATCH_LANES 64
+
+/* an AVX2 copy of a function as well, picked at load time, on x86-64 */
+#if defined(__x86_64__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+typedef word vword __attribute__((vector_size(32)));
+typedef uint64_t vuword __attribute__((vector_size(32)));
+
+/* narrower lanes, more to a vector; see narrow_bits */
+typedef int32_t vword32 __attribute__((vector_size(32)));
+typedef uint32_t vuword32 __attribute__((vector_size(32)));
+typedef int16_t vword16 __attribute__((vector_size(32)));
+typedef uint16_t vuword16 __attribute__((vector_size(32)));
+typedef int8_t vword8 __attribute__((vector_size(32)));
+typedef uint8_t vuword8 __attribute__((vector_size(32)));
+
+#define BATCH_VECS (BATCH_LANES * sizeof(word) / sizeof(vword))
+
+struct batch_slot {
+  union {
+    vword v[BATCH_VECS];
+    vword32 v32[BATCH_VECS];
+    vword16 v16[BATCH_VECS];
+    vword8 v8[BATCH_VECS];
+  };
+};
+
+/* the lanes in a slot, when they are of the given number of bits */
+#define SLOT_LANES(bits) (BATCH_LANES * 64 / (bits))
+
+/* lane l of slot k, for the scalar parts */
+#define LANE(slot, l) (((word *)(slot).v)[l])
+
+#define FOR_VECS(v) for (size_t v = 0; v < BATCH_VECS; v++)
+
+struct dc_node {
+  u_char op;                    /* OP_ARG, OP_PUSH, or an operation */
+  word arg;                     /* argument number, literal or immediate */
+  int lhs, rhs;                 /* operands; lhs was lower on the stack */
+  int prf_first, prf_n;         /* for OP_PRF, the values hashed */
+  int slot;                     /* batch slot holding the value */
+  u_char demanded;              /* low bits of the value that are used */
+
+  /* for OP_DIV_IMM and OP_MOD_IMM, and OP_PRF with a literal range */
+  bool recip;
+  union {
+    struct sdiv sdiv;
+    struct udiv udiv;
+  };
+};
+
+static int
+add_node(struct dc_prog *prog, size_t *cap, u_char op, word arg, int lhs,
+         int rhs)
+{
+  if (prog->nnodes == *cap) {
+    *cap = *cap * 2 + 8;
+    prog->nodes = reallocarray(prog->nodes, *cap, sizeof(*prog->nodes));
+    assert(prog->nodes != NULL);
+  }
+  prog->nodes[prog->nnodes] = (struct dc_node){
+    .op = op, .arg = arg, .lhs = lhs, .rhs = rhs,
+  };
+  return prog->nnodes++;
+}
+
+/* whether a node has to be evaluated even if its value is never used */
+static bool
+node_can_fail(u_char op)
+{
+  return op == OP_DIV || op == OP_MOD || op == OP_SHL || op == OP_SHR
+    || op == OP_PRF;
+}
+
+/* whether the low bits of op's value depend only on those of its operands */
+static bool
+low_bits_op(u_char op)
+{
+  switch (op) {
+  case OP_ADD: case OP_SUB: case OP_MUL:
+  case OP_BAND: case OP_BOR: case OP_BXOR:
+  case OP_ADD_IMM: case OP_MUL_IMM:
+  case OP_BAND_IMM: case OP_BOR_IMM: case OP_BXOR_IMM: case OP_SHL_IMM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Which low bits of each node's value anything uses: result_bits of
+ * the results, as many of an operand of a low_bits_op as of its value,
+ * and all 64 of any other operand.
+ */
+static void
+find_demanded(struct dc_prog *prog)
+{
+  for (int i = 0; i < prog->nnodes; i++)
+    prog->nodes[i].demanded = 0;
+  for (int k = 0; k < prog->nresults; k++)
+    prog->nodes[prog->results[k]].demanded = prog->result_bits;
+  for (int i = prog->nnodes - 1; i >= 0; i--) {
+    const struct dc_node *nd = &prog->nodes[i];
+    int bits = low_bits_op(nd->op) ? nd->demanded : 64;
+    int operands[] = { nd->lhs, nd->rhs };
+    for (int k = 0; k < 2 + nd->prf_n; k++) {
+      int o = (k < 2) ? operands[k]
+        : prog->prf_operands[nd->prf_first + k - 2];
+      if (o >= 0 && prog->nodes[o].demanded < bits)
+        prog->nodes[o].demanded = bits;
+    }
+  }
+}
+
+static void
+build_graph(struct dc_prog *prog)
+{
+  int *stack = calloc(prog->max_depth + 1, sizeof(*stack));
+  int *regs = calloc(prog->nregs + 1, sizeof(*regs));
+  assert(stack != NULL && regs != NULL);
+  size_t cap = 0, prf_cap = 0;
+  ssize_t depth = 0;
+
+  for (int k = 0; k < prog->nargs; k++)
+    stack[depth++] = add_node(prog, &cap, OP_ARG, k, -1, -1);
+
+  for (size_t pc = 0; pc < prog->ncode; pc++) {
+    const struct dc_insn *insn = &prog->code[pc];
+    int tmp;
+
+    switch (insn->op) {
+    case OP_NOP:
+      break;
+    case OP_PUSH:
+      stack[depth++] = add_node(prog, &cap, OP_PUSH, insn->arg, -1, -1);
+      break;
+    case OP_DIVMOD:
+      tmp = add_node(prog, &cap, OP_DIV, 0, stack[depth-2], stack[depth-1]);
+      stack[depth-1] = add_node(prog, &cap, OP_MOD, 0, stack[depth-2],
+                                stack[depth-1]);
+      stack[depth-2] = tmp;
+      break;
+    case OP_DUP:
+      stack[depth] = stack[depth-1];
+      depth++;
+      break;
+    case OP_SWAP:
+      tmp = stack[depth-1];
+      stack[depth-1] = stack[depth-2];
+      stack[depth-2] = tmp;
+      break;
+    case OP_ROT:
+      tmp = stack[depth-3];
+      stack[depth-3] = stack[depth-2];
+      stack[depth-2] = stack[depth-1];
+      stack[depth-1] = tmp;
+      break;
+    case OP_DROP:
+      depth--;
+      break;
+    case OP_CLEAR:
+      depth = 0;
+      break;
+    case OP_STORE:
+      regs[insn->arg] = stack[--depth];
+      break;
+    case OP_LOAD:
+      /* compile_prog only loads registers already stored to */
+      stack[depth++] = regs[insn->arg];
+      break;
+    case OP_PRF:
+      tmp = add_node(prog, &cap, OP_PRF, 0, -1, stack[depth-1]);
+      if (prog->nprf_operands + depth - 1 > (ssize_t)prf_cap) {
+        prf_cap = prf_cap * 2 + depth;
+        prog->prf_operands = reallocarray(prog->prf_operands, prf_cap,
+                                          sizeof(*prog->prf_operands));
+        assert(prog->prf_operands != NULL);
+      }
+      prog->nodes[tmp].prf_first = prog->nprf_operands;
+      prog->nodes[tmp].prf_n = depth - 1;
+      memcpy(prog->prf_operands + prog->nprf_operands, stack,
+             (depth - 1) * sizeof(*stack));
+      prog->nprf_operands += depth - 1;
+      stack[depth-1] = tmp;
+      break;
+    case OP_END:
+      prog->results = calloc(prog->nresults, sizeof(*prog->results));
+      assert(prog->results != NULL);
+      for (int k = 0; k < prog->nresults; k++)
+        prog->results[k] = stack[depth - prog->nresults + k];
+      break;
+    default:
+      /* the other opcodes left by optimize_prog pop 1 or 2 and push 1 */
+      assert(op_pushes[insn->op] == 1);
+      if (op_pops[insn->op] == 1)
+        tmp = add_node(prog, &cap, insn->op, insn->arg, stack[depth-1], -1);
+      else
+        tmp = add_node(prog, &cap, insn->op, insn->arg, stack[depth-2],
+                       stack[depth-1]);
+      depth -= op_pops[insn->op];
+      stack[depth++] = tmp;
+      break;
+    }
+  }
+  free(stack);
+  free(regs);
+  finish_graph(prog);
+}
+
+/*
+ * Drop the nodes that neither lead to a result nor can fail, put the
+ * arguments first, as run_prog_batch expects, and give each node a
+ * slot, reusing those of values no longer needed.
+ */
+static void
+finish_graph(struct dc_prog *prog)
+{
+  int nnodes = prog->nnodes;
+  struct dc_node *nodes = calloc(nnodes, sizeof(*nodes));
+  bool *live = calloc(nnodes, sizeof(*live));
+  int *renumber = calloc(nnodes, sizeof(*renumber));
+  int *last_use = calloc(nnodes, sizeof(*last_use));
+  int *free_slots = calloc(nnodes, sizeof(*free_slots));
+  assert(nodes != NULL && live != NULL && renumber != NULL
+         && last_use != NULL && free_slots != NULL);
+  for (int k = 0; k < prog->nresults; k++)
+    live[prog->results[k]] = true;
+  for (int i = nnodes - 1; i >= 0; i--) {
+    struct dc_node *nd = &prog->nodes[i];
+    if (!live[i] && !node_can_fail(nd->op))
+      continue;
+    live[i] = true;
+    if (nd->lhs >= 0)
+      live[nd->lhs] = true;
+    if (nd->rhs >= 0)
+      live[nd->rhs] = true;
+    for (int k = 0; k < nd->prf_n; k++)
+      live[prog->prf_operands[nd->prf_first + k]] = true;
+  }
+  int n = 0;
+  for (int pass = 0; pass < 2; pass++)
+    for (int i = 0; i < nnodes; i++)
+      if (live[i] && (prog->nodes[i].op == OP_ARG) == (pass == 0)) {
+        renumber[i] = n;
+        nodes[n++] = prog->nodes[i];
+      }
+  for (int i = 0; i < n; i++) {
+    struct dc_node *nd = &nodes[i];
+    if (nd->lhs >= 0)
+      nd->lhs = renumber[nd->lhs];
+    if (nd->rhs >= 0)
+      nd->rhs = renumber[nd->rhs];
+    for (int k = 0; k < nd->prf_n; k++)
+      prog->prf_operands[nd->prf_first + k] =
+        renumber[prog->prf_operands[nd->prf_first + k]];
+  }
+  free(prog->nodes);
+  prog->nodes = nodes;
+  prog->nnodes = n;
+  for (int k = 0; k < prog->nresults; k++)
+    prog->results[k] = renumber[prog->results[k]];
+
+  for (int i = 0; i < n; i++) {
+    const struct dc_node *nd = &nodes[i];
+    last_use[i] = i;
+    if (nd->lhs >= 0)
+      last_use[nd->lhs] = i;
+    if (nd->rhs >= 0)
+      last_use[nd->rhs] = i;
+    for (int k = 0; k < nd->prf_n; k++)
+      last_use[prog->prf_operands[nd->prf_first + k]] = i;
+  }
+  for (int k = 0; k < prog->nresults; k++)
+    last_use[prog->results[k]] = n;
+
+  /* operations work lane by lane, so a result may reuse an operand's slot */
+  int nfree = 0;
+  for (int i = 0; i < n; i++) {
+    struct dc_node *nd = &nodes[i];
+    int operands[] = { nd->lhs, nd->rhs };
+    for (int k = 0; k < 2 + nd->prf_n; k++) {
+      int o = (k < 2) ? operands[k] : prog->prf_operands[nd->prf_first + k - 2];
+      if (o >= 0 && last_use[o] == i) {
+        free_slots[nfree++] = nodes[o].slot;
+        last_use[o] = -1;
+      }
+    }
+    nd->slot = (nfree > 0) ? free_slots[--nfree] : prog->nslots++;
+    if (last_use[i] == i)
+      free_slots[nfree++] = nd->slot;
+  }
+
+  /* reciprocals of constant divisors */
+  for (int i = 0; i < n; i++) {
+    struct dc_node *nd = &nodes[i];
+    const struct dc_node *y = (nd->rhs >= 0) ? &nodes[nd->rhs] : NULL;
+    nd->recip = false;
+    if ((nd->op == OP_DIV_IMM || nd->op == OP_MOD_IMM)
+        && nd->arg != 1 && operand_ok(nd->op, nd->arg) && nd->arg != LONG_MIN) {
+      sdiv_init(&nd->sdiv, nd->arg);
+      nd->recip = true;
+    } else if (nd->op == OP_PRF && y->op == OP_PUSH && y->arg >= 2) {
+      udiv_init(&nd->udiv, y->arg);
+      nd->recip = true;
+    }
+  }
+
+  prog->result_bits = 64;
+  find_demanded(prog);
+
+  free(live);
+  free(renumber);
+  free(last_use);
+  free(free_slots);
+}
+
+/*
+ * Fused programs: one graph computing the results of several programs,
+ * such as the four channel programs of a texture, from the same
+ * arguments.  Argument fixed_arg is replaced by the constant k in
+ * progs[k], and what that makes constant is folded; the fused program
+ * takes the other arguments, in order.  Nodes that do the
+ * same operation on the same operands are then merged, within a
+ * program and across programs, so that work the programs share is done
+ * once per pixel rather than once per program, and programs computing
+ * the same values share one result.  run_prog_batch stores the results
+ * one after the other.  A NULL program's result is 0.
+ */
+
+static uint64_t
+hash_node(const struct dc_prog *prog, const struct dc_node *nd)
+{
+  uint64_t h = nd->op;
+  h = h * 0x9e3779b97f4a7c15 + (uint64_t)nd->arg;
+  h = h * 0x9e3779b97f4a7c15 + (uint64_t)nd->lhs;
+  h = h * 0x9e3779b97f4a7c15 + (uint64_t)nd->rhs;
+  for (int k = 0; k < nd->prf_n; k++)
+    h = h * 0x9e3779b97f4a7c15 + prog->prf_operands[nd->prf_first + k];
+  return h ^ h >> 29;
+}
+
+static bool
+same_node(const struct dc_prog *prog, const struct dc_node *a,
+          const struct dc_node *b)
+{
+  return a->op == b->op && a->arg == b->arg && a->lhs == b->lhs
+    && a->rhs == b->rhs && a->prf_n == b->prf_n
+    && (a->prf_n == 0
+        || memcmp(prog->prf_operands + a->prf_first,
+                  prog->prf_operands + b->prf_first,
+                  a->prf_n * sizeof(*prog->prf_operands)) == 0);
+}
+
+/* nd with its operands folded, if they are literals and it cannot fail */
+static struct dc_node
+fold_node(const struct dc_prog *prog, struct dc_node nd)
+{
+  const struct dc_node *x = (nd.lhs >= 0) ? &prog->nodes[nd.lhs] : NULL;
+  const struct dc_node *y = (nd.rhs >= 0) ? &prog->nodes[nd.rhs] : NULL;
+
+  if (nd.op == OP_PRF || x == NULL || x->op != OP_PUSH)
+    return nd;
+  if (y == NULL && nd.op == OP_NOT)
+    nd.arg = !x->arg;
+  else if (y == NULL)
+    nd.arg = fold_binary(nd.op, x->arg, nd.arg);
+  else if (y->op == OP_PUSH && operand_ok(nd.op, y->arg))
+    nd.arg = fold_binary(nd.op, x->arg, y->arg);
+  else
+    return nd;
+  return (struct dc_node){ .op = OP_PUSH, .arg = nd.arg, .lhs = -1,
+                           .rhs = -1 };
+}
+
+struct dc_prog *
+fuse_progs(struct dc_prog *const progs[], int nprogs, int nargs,
+           int fixed_arg)
+{
+  size_t total = nprogs, width = 1, max_nodes = 0;
+  for (int k = 0; k < nprogs; k++) {
+    if (progs[k] == NULL)
+      continue;
+    assert(progs[k]->nargs == nargs && progs[k]->nresults == 1);
+    if (!progs[k]->static_depth)
+      return NULL;
+    total += progs[k]->nnodes;
+    if (progs[k]->nnodes > max_nodes)
+      max_nodes = progs[k]->nnodes;
+  }
+  while (width < 2 * total)
+    width *= 2;
+
+  struct dc_prog *prog = calloc(1, sizeof(*prog));
+  int *table = malloc(width * sizeof(*table));
+  int *map = calloc(max_nodes + 1, sizeof(*map));
+  assert(prog != NULL && table != NULL && map != NULL);
+  prog->id = __atomic_add_fetch(&next_prog_id, 1, __ATOMIC_RELAXED);
+  prog->nargs = (fixed_arg >= 0) ? nargs - 1 : nargs;
+  prog->static_depth = true;
+  prog->nresults = nprogs;
+  prog->results = calloc(nprogs, sizeof(*prog->results));
+  assert(prog->results != NULL);
+  memset(table, -1, width * sizeof(*table));
+  size_t cap = 0, prf_cap = 0;
+
+  for (int k = 0; k < nprogs; k++) {
+    const struct dc_prog *p = progs[k];
+    int nnodes = (p != NULL) ? p->nnodes : 1;
+
+    if (p != NULL && p->max_depth > prog->max_depth)
+      prog->max_depth = p->max_depth;
+    for (int i = 0; i < nnodes; i++) {
+      struct dc_node nd = { .op = OP_PUSH, .arg = 0, .lhs = -1, .rhs = -1 };
+      if (p != NULL) {
+        nd = p->nodes[i];
+        if (nd.op == OP_ARG && nd.arg == fixed_arg)
+          nd = (struct dc_node){ .op = OP_PUSH, .arg = k, .lhs = -1,
+                                 .rhs = -1 };
+        else if (nd.op == OP_ARG && fixed_arg >= 0 && nd.arg > fixed_arg)
+          nd.arg--;
+        if (nd.lhs >= 0)
+          nd.lhs = map[nd.lhs];
+        if (nd.rhs >= 0)
+          nd.rhs = map[nd.rhs];
+        if (nd.prf_n > 0) {
+          if (prog->nprf_operands + nd.prf_n > prf_cap) {
+            prf_cap = prf_cap * 2 + nd.prf_n;
+            prog->prf_operands = reallocarray(prog->prf_operands, prf_cap,
+                                              sizeof(*prog->prf_operands));
+            assert(prog->prf_operands != NULL);
+          }
+          for (int j = 0; j < nd.prf_n; j++)
+            prog->prf_operands[prog->nprf_operands + j] =
+              map[p->prf_operands[nd.prf_first + j]];
+          nd.prf_first = prog->nprf_operands;
+        }
+        nd = fold_node(prog, nd);
+      }
+
+      /* reuse an equal node if there is one */
+      size_t h = hash_node(prog, &nd) & (width - 1);
+      while (table[h] >= 0 && !same_node(prog, &prog->nodes[table[h]], &nd))
+        h = (h + 1) & (width - 1);
+      if (table[h] < 0) {
+        table[h] = add_node(prog, &cap, nd.op, nd.arg, nd.lhs, nd.rhs);
+        prog->nodes[table[h]].prf_first = nd.prf_first;
+        prog->nodes[table[h]].prf_n = nd.prf_n;
+        prog->nprf_operands += nd.prf_n;
+      }
+      map[i] = table[h];
+    }
+    prog->results[k] = map[(p != NULL) ? p->results[0] : 0];
+  }
+  free(table);
+  free(map);
+
+  finish_graph(prog);
+  find_polynomial(prog);
+  return prog;
+}
+
+/* how run_prog_batch gets each node's value in one call */
+enum { NODE_VECTOR, NODE_SCALAR, NODE_CACHED };
+
+struct node_plan {
+  u_char how;
+  bool uniform;                 /* inputs the same in every lane */
+  bool stable;                  /* inputs the same as in the last call */
+  bool needed;                  /* in a slot, for a vector operation */
+  int cache_index;              /* row of ctx->cache, or -1 */
+  word scalar;                  /* the value, for NODE_SCALAR */
+
+  /* for OP_PRF, the uniform words at the bottom of the stacks hashed */
+  int prf_prefix;
+  struct siphash_state prf_state;
+};
+
+/* evaluate nd once, for a call in which all its inputs are uniform */
+static word
+scalar_node(const struct dc_prog *prog, const struct dc_node *nd,
+            const struct node_plan *plan, word *scratch,
+            const word *const args[])
+{
+  word x = (nd->lhs >= 0) ? plan[nd->lhs].scalar : 0;
+  word y = (nd->rhs >= 0) ? plan[nd->rhs].scalar : 0;
+
+  switch (nd->op) {
+  case OP_ARG:
+    return args[nd->arg][0];
+  case OP_PUSH:
+    return nd->arg;
+  case OP_NOT:
+    return !x;
+  case OP_DIV:
+  case OP_MOD:
+    assert(y != 0);
+    return fold_binary(nd->op, x, y);
+  case OP_SHL:
+  case OP_SHR:
+    assert(y >= 0 && y <= 63);
+    return fold_binary(nd->op, x, y);
+  case OP_PRF: {
+    assert(y > 0);
+    for (int k = 0; k < nd->prf_n; k++)
+      scratch[k] = plan[prog->prf_operands[nd->prf_first + k]].scalar;
+
+    uint64_t prf_out = prf_hash(scratch, nd->prf_n);
+    return (word)(prf_out % (uint64_t)y);
+  }
+  default:
+    if (is_imm_op(nd->op))
+      return fold_binary(nd->op, x, nd->arg);
+    return fold_binary(nd->op, x, y);
+  }
+}
+
+/* evaluate nd in every lane, with its operands already in their slots */
+BATCH_CLONES
+static void
+vector_node(const struct dc_prog *prog, const struct dc_node *nd,
+            struct batch_slot *s)
+{
+  struct batch_slot *d = &s[nd->slot];
+  struct batch_slot *x = (nd->lhs >= 0) ? &s[prog->nodes[nd->lhs].slot] : NULL;
+  struct batch_slot *y = (nd->rhs >= 0) ? &s[prog->nodes[nd->rhs].slot] : NULL;
+  vword any;
+
+  switch (nd->op) {
+  case OP_ADD:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] + (vuword)y->v[v]);
+    break;
+  case OP_SUB:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] - (vuword)y->v[v]);
+    break;
+  case OP_MUL:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] * (vuword)y->v[v]);
+    break;
+  case OP_DIV:
+  case OP_MOD:
+    any = (vword){ 0 };
+    FOR_VECS(v)
+      any |= y->v[v] == 0;
+    for (int l = 0; l < sizeof(vword) / sizeof(word); l++)
+      assert(any[l] == 0);
+    if (nd->op == OP_DIV)
+      FOR_VECS(v)
+        d->v[v] = x->v[v] / y->v[v];
+    else
+      FOR_VECS(v)
+        d->v[v] = x->v[v] % y->v[v];
+    break;
+  case OP_NOT:
+    FOR_VECS(v)
+      d->v[v] = (x->v[v] == 0) & 1;
+    break;
+  case OP_OR:
+    FOR_VECS(v)
+      d->v[v] = ((x->v[v] | y->v[v]) != 0) & 1;
+    break;
+  case OP_AND:
+    FOR_VECS(v)
+      d->v[v] = (x->v[v] != 0) & (y->v[v] != 0) & 1;
+    break;
+  case OP_BOR:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] | y->v[v];
+    break;
+  case OP_BAND:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] & y->v[v];
+    break;
+  case OP_BXOR:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] ^ y->v[v];
+    break;
+  case OP_SHL:
+  case OP_SHR:
+    any = (vword){ 0 };
+    FOR_VECS(v)
+      any |= (vword)((vuword)y->v[v] > 63);
+    for (int l = 0; l < sizeof(vword) / sizeof(word); l++)
+      assert(any[l] == 0);
+    if (nd->op == OP_SHL)
+      FOR_VECS(v)
+        d->v[v] = (vword)((vuword)x->v[v] << (vuword)y->v[v]);
+    else
+      FOR_VECS(v)
+        d->v[v] = x->v[v] >> y->v[v];
+    break;
+  /* comparisons compare the popped top against the value below it */
+  case OP_EQ:
+    FOR_VECS(v)
+      d->v[v] = (y->v[v] == x->v[v]) & 1;
+    break;
+  case OP_LT:
+    FOR_VECS(v)
+      d->v[v] = (y->v[v] < x->v[v]) & 1;
+    break;
+  case OP_LE:
+    FOR_VECS(v)
+      d->v[v] = (y->v[v] <= x->v[v]) & 1;
+    break;
+  case OP_GT:
+    FOR_VECS(v)
+      d->v[v] = (y->v[v] > x->v[v]) & 1;
+    break;
+  case OP_GE:
+    FOR_VECS(v)
+      d->v[v] = (y->v[v] >= x->v[v]) & 1;
+    break;
+  case OP_ADD_IMM:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] + (uint64_t)nd->arg);
+    break;
+  case OP_MUL_IMM:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] * (uint64_t)nd->arg);
+    break;
+  case OP_DIV_IMM:
+    if (nd->recip)
+      for (size_t l = 0; l < BATCH_LANES; l++)
+        LANE(*d, l) = sdiv_quot(&nd->sdiv, LANE(*x, l));
+    else
+      FOR_VECS(v)
+        d->v[v] = x->v[v] / nd->arg;
+    break;
+  case OP_MOD_IMM:
+    if (nd->recip)
+      for (size_t l = 0; l < BATCH_LANES; l++)
+        LANE(*d, l) = sdiv_rem(&nd->sdiv, LANE(*x, l));
+    else
+      FOR_VECS(v)
+        d->v[v] = x->v[v] % nd->arg;
+    break;
+  case OP_BOR_IMM:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] | nd->arg;
+    break;
+  case OP_BAND_IMM:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] & nd->arg;
+    break;
+  case OP_BXOR_IMM:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] ^ nd->arg;
+    break;
+  case OP_SHL_IMM:
+    FOR_VECS(v)
+      d->v[v] = (vword)((vuword)x->v[v] << nd->arg);
+    break;
+  case OP_SHR_IMM:
+    FOR_VECS(v)
+      d->v[v] = x->v[v] >> nd->arg;
+    break;
+  case OP_DIV_POW2:
+  case OP_MOD_POW2: {
+    word mask = ((word)1 << nd->arg) - 1;
+    FOR_VECS(v) {
+      vword bias = (x->v[v] >> 63) & mask;
+      if (nd->op == OP_DIV_POW2)
+        d->v[v] = (x->v[v] + bias) >> nd->arg;
+      else
+        d->v[v] = ((x->v[v] + bias) & mask) - bias;
+    }
+    break;
+  }
+  default:
+    assert(0);
+  }
+}
+
+/*
+ * Narrow lanes.  When every value a batch computes per pixel fits in
+ * 32, 16 or 8 bits -- or only that many of its low bits are used, and
+ * those depend only on the low bits of its operands -- the batch is
+ * computed with lanes of that width instead, so that each vector
+ * operation covers two, four or eight times as many pixels.  See
+ * narrow_bits for when that is so.  Operations with no cheap narrow
+ * form are done a lane at a time on operands widened back to words,
+ * which narrow_bits makes sure are exact.
+ */
+
+/* nd on one lane's operands */
+static word
+lane_node(const struct dc_node *nd, word x, word y)
+{
+  switch (nd->op) {
+  case OP_DIV_IMM:
+    return nd->recip ? sdiv_quot(&nd->sdiv, x) : x / nd->arg;
+  case OP_MOD_IMM:
+    return nd->recip ? sdiv_rem(&nd->sdiv, x) : x % nd->arg;
+  case OP_DIV:
+  case OP_MOD:
+    assert(y != 0);
+    return fold_binary(nd->op, x, y);
+  case OP_SHL:
+  case OP_SHR:
+    assert(y >= 0 && y <= 63);
+    return fold_binary(nd->op, x, y);
+  default:
+    if (is_imm_op(nd->op))
+      return fold_binary(nd->op, x, nd->arg);
+    return fold_binary(nd->op, x, y);
+  }
+}
+
+/* vector_node, for lanes of the given number of bits */
+#define DEFINE_NARROW_NODE(bits)                                        \
+BATCH_CLONES                                                            \
+static void                                                             \
+narrow_node##bits(const struct dc_prog *prog, const struct dc_node *nd, \
+                  struct batch_slot *s, size_t nlanes)                  \
+{                                                                       \
+  typedef vword##bits vw;                                               \
+  typedef vuword##bits vu;                                              \
+  typedef int##bits##_t lane;                                           \
+  typedef uint##bits##_t ulane;                                         \
+  vw *d = s[nd->slot].v##bits;                                          \
+  vw *x = (nd->lhs >= 0) ? s[prog->nodes[nd->lhs].slot].v##bits : NULL; \
+  vw *y = (nd->rhs >= 0) ? s[prog->nodes[nd->rhs].slot].v##bits : NULL; \
+  lane *dl = (lane *)d, *xl = (lane *)x, *yl = (lane *)y;               \
+  lane imm = nd->arg;                                                   \
+                                                                        \
+  switch (nd->op) {                                                     \
+  case OP_ADD:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = (vw)((vu)x[v] + (vu)y[v]);                                 \
+    break;                                                              \
+  case OP_SUB:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = (vw)((vu)x[v] - (vu)y[v]);                                 \
+    break;                                                              \
+  case OP_MUL:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = (vw)((vu)x[v] * (vu)y[v]);                                 \
+    break;                                                              \
+  case OP_BAND:                                                         \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] & y[v];                                               \
+    break;                                                              \
+  case OP_BOR:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] | y[v];                                               \
+    break;                                                              \
+  case OP_BXOR:                                                         \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] ^ y[v];                                               \
+    break;                                                              \
+  case OP_NOT:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = (x[v] == 0) & 1;                                           \
+    break;                                                              \
+  case OP_OR:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = ((x[v] | y[v]) != 0) & 1;                                  \
+    break;                                                              \
+  case OP_AND:                                                          \
+    FOR_VECS(v)                                                         \
+      d[v] = (x[v] != 0) & (y[v] != 0) & 1;                             \
+    break;                                                              \
+  case OP_EQ:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = (y[v] == x[v]) & 1;                                        \
+    break;                                                              \
+  case OP_LT:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = (y[v] < x[v]) & 1;                                         \
+    break;                                                              \
+  case OP_LE:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = (y[v] <= x[v]) & 1;                                        \
+    break;                                                              \
+  case OP_GT:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = (y[v] > x[v]) & 1;                                         \
+    break;                                                              \
+  case OP_GE:                                                           \
+    FOR_VECS(v)                                                         \
+      d[v] = (y[v] >= x[v]) & 1;                                        \
+    break;                                                              \
+  case OP_ADD_IMM:                                                      \
+    FOR_VECS(v)                                                         \
+      d[v] = (vw)((vu)x[v] + (ulane)imm);                               \
+    break;                                                              \
+  case OP_MUL_IMM:                                                      \
+    FOR_VECS(v)                                                         \
+      d[v] = (vw)((vu)x[v] * (ulane)imm);                               \
+    break;                                                              \
+  case OP_BAND_IMM:                                                     \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] & imm;                                                \
+    break;                                                              \
+  case OP_BOR_IMM:                                                      \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] | imm;                                                \
+    break;                                                              \
+  case OP_BXOR_IMM:                                                     \
+    FOR_VECS(v)                                                         \
+      d[v] = x[v] ^ imm;                                                \
+    break;                                                              \
+  case OP_SHL_IMM:                                                      \
+    FOR_VECS(v)                                                         \
+      d[v] = (nd->arg < bits) ? (vw)((vu)x[v] << nd->arg) : (vw){ 0 };  \
+    break;                                                              \
+  case OP_DIV_IMM:                                                      \
+  case OP_MOD_IMM:                                                      \
+    for (size_t l = 0; l < SLOT_LANES(bits); l++)                       \
+      dl[l] = !nd->recip ? lane_node(nd, xl[l], 0)                      \
+        : (nd->op == OP_DIV_IMM) ? sdiv_quot(&nd->sdiv, xl[l])          \
+        : sdiv_rem(&nd->sdiv, xl[l]);                                   \
+    break;                                                              \
+  default:                                                              \
+    for (size_t l = 0; l < nlanes; l++)                                 \
+      dl[l] = lane_node(nd, xl ? xl[l] : 0, yl ? yl[l] : 0);            \
+    for (size_t l = nlanes; l < SLOT_LANES(bits); l++)                  \
+      dl[l] = dl[nlanes - 1];                                           \
+    break;                                                              \
+  }                                                                     \
+}
+
+DEFINE_NARROW_NODE(32)
+DEFINE_NARROW_NODE(16)
+DEFINE_NARROW_NODE(8)
+
+/* words, as many as fill one vector of narrow lanes */
+typedef word vwide32 __attribute__((vector_size(64)));
+typedef word vwide16 __attribute__((vector_size(128)));
+typedef word vwide8 __attribute__((vector_size(256)));
+
+/* copy nlanes values into a slot, repeating the last in the lanes after */
+BATCH_CLONES
+static void
+load_lanes(struct batch_slot *slot, const word *values, size_t nlanes,
+           int bits)
+{
+  if (bits == 64) {
+    memcpy(slot->v, values, nlanes * sizeof(word));
+    for (size_t l = nlanes; l < BATCH_LANES; l++)
+      LANE(*slot, l) = values[nlanes - 1];
+    return;
+  }
+
+  size_t vlanes = sizeof(vword) * 8 / bits;
+  FOR_VECS(v) {
+    word w[sizeof(vwide8) / sizeof(word)];
+    const word *src = values + v * vlanes;
+    if ((v + 1) * vlanes > nlanes) {
+      for (size_t l = 0; l < vlanes; l++)
+        w[l] = values[(v * vlanes + l < nlanes) ? v * vlanes + l : nlanes - 1];
+      src = w;
+    }
+    switch (bits) {
+    case 32: {
+      vwide32 wide;
+      memcpy(&wide, src, sizeof(wide));
+      slot->v32[v] = __builtin_convertvector(wide, vword32);
+      break;
+    }
+    case 16: {
+      vwide16 wide;
+      memcpy(&wide, src, sizeof(wide));
+      slot->v16[v] = __builtin_convertvector(wide, vword16);
+      break;
+    }
+    case 8: {
+      vwide8 wide;
+      memcpy(&wide, src, sizeof(wide));
+      slot->v8[v] = __builtin_convertvector(wide, vword8);
+      break;
+    }
+    }
+  }
+}
+
+/* the value in every lane of a slot */
+static void
+fill_lanes(struct batch_slot *slot, word value, int bits)
+{
+  FOR_VECS(v) {
+    switch (bits) {
+    case 64: slot->v[v] = (vword){ 0 } + value; break;
+    case 32: slot->v32[v] = (vword32){ 0 } + (int32_t)value; break;
+    case 16: slot->v16[v] = (vword16){ 0 } + (int16_t)value; break;
+    case 8:  slot->v8[v] = (vword8){ 0 } + (int8_t)value; break;
+    }
+  }
+}
+
+/* copy the first nlanes values out of a slot, widened to words */
+BATCH_CLONES
+static void
+store_lanes(word *values, const struct batch_slot *slot, size_t nlanes,
+            int bits)
+{
+  if (bits == 64) {
+    memcpy(values, slot->v, nlanes * sizeof(word));
+    return;
+  }
+
+  size_t vlanes = sizeof(vword) * 8 / bits;
+  for (size_t v = 0; v * vlanes < nlanes; v++) {
+    word *dst = values + v * vlanes;
+    bool whole = (v + 1) * vlanes <= nlanes;
+    word w[sizeof(vwide8) / sizeof(word)];
+
+    switch (bits) {
+    case 32: {
+      vwide32 wide = __builtin_convertvector(slot->v32[v], vwide32);
+      memcpy(whole ? dst : w, &wide, sizeof(wide));
+      break;
+    }
+    case 16: {
+      vwide16 wide = __builtin_convertvector(slot->v16[v], vwide16);
+      memcpy(whole ? dst : w, &wide, sizeof(wide));
+      break;
+    }
+    case 8: {
+      vwide8 wide = __builtin_convertvector(slot->v8[v], vwide8);
+      memcpy(whole ? dst : w, &wide, sizeof(wide));
+      break;
+    }
+    }
+    if (!whole)
+      memcpy(dst, w, (nlanes - v * vlanes) * sizeof(word));
+  }
+}
+
+/*
+ * $ in lanes [0, nlanes) of a batch.  Each lane hashes its own stack,
+ * but the words at the bottom that are uniform in the call -- in dump,
+ * chan and row -- are the same in every lane, so eval_batch absorbs
+ * them once per call into p->prf_state.  The rest of each stack is
+ * widened into scratch one operand per row, for siphash_batch_from to
+ * continue from there SIPHASH_BATCH lanes at a time.  The rows are
+ * padded to a whole number of those with copies of the last lane.
+ */
+static void
+prf_node(const struct dc_prog *prog, const struct dc_node *nd,
+         const struct node_plan *p, struct batch_slot *s, word *scratch,
+         size_t nlanes, int bits)
+{
+  uint64_t hashes[SLOT_LANES(8)];
+  word ranges[SLOT_LANES(8)];
+  int nwords = nd->prf_n - p->prf_prefix;
+  size_t stride = (nlanes + SIPHASH_BATCH - 1) / SIPHASH_BATCH
+    * SIPHASH_BATCH;
+
+  for (int k = 0; k < nwords; k++) {
+    int o = prog->prf_operands[nd->prf_first + p->prf_prefix + k];
+    word *row = scratch + k * stride;
+    store_lanes(row, &s[prog->nodes[o].slot], nlanes, bits);
+    for (size_t l = nlanes; l < stride; l++)
+      row[l] = row[nlanes - 1];
+  }
+  for (size_t first = 0; first < nlanes; first += SIPHASH_BATCH)
+    siphash_batch_from(&p->prf_state, (const uint64_t *)scratch + first,
+                       nwords, stride, hashes + first);
+
+  word *values = (word *)hashes;
+  if (nd->recip) {
+    for (size_t l = 0; l < nlanes; l++)
+      values[l] = udiv_rem(&nd->udiv, hashes[l]);
+  } else {
+    store_lanes(ranges, &s[prog->nodes[nd->rhs].slot], nlanes, bits);
+    for (size_t l = 0; l < nlanes; l++) {
+      assert(ranges[l] > 0);
+      values[l] = hashes[l] % (uint64_t)ranges[l];
+    }
+  }
+  load_lanes(&s[nd->slot], values, nlanes, bits);
+}
+
+/* evaluate nd in every lane, for lanes of the given width */
+static void
+batch_node(const struct dc_prog *prog, const struct dc_node *nd,
+           const struct node_plan *p, struct batch_slot *s, word *scratch,
+           size_t nlanes, int bits)
+{
+  if (nd->op == OP_PRF) {
+    prf_node(prog, nd, p, s, scratch, nlanes, bits);
+    return;
+  }
+  switch (bits) {
+  case 64: vector_node(prog, nd, s); break;
+  case 32: narrow_node32(prog, nd, s, nlanes); break;
+  case 16: narrow_node16(prog, nd, s, nlanes); break;
+  case 8:  narrow_node8(prog, nd, s, nlanes); break;
+  }
+}
+
+/* make room for n words at *buf, which holds *len, one of ctx's */
+static void
+grow_words(struct dc_ctx *ctx, word **buf, size_t *len, size_t n)
+{
+  if (*len < n) {
+    ctx->grows++;
+    free(*buf);
+    *len = n;
+    *buf = calloc(n, sizeof(**buf));
+    assert(*buf != NULL);
+  }
+}
+
+static void
+eval_batch(const struct dc_prog *prog, struct dc_ctx *ctx,
+           const word *const args[], int nargs, size_t n, word *out)
+{
+  struct dc_profile *prof = ctx->profile;
+
+  if (!prog->static_depth) {
+    if (prof != NULL) {
+      prof->interpreted += n;
+      for (size_t pc = 0; pc < prog->ncode - 1; pc++)   /* not OP_END */
+        prof->ops[prog->code[pc].op] += n;
+    }
+    word *pixel_args = calloc(nargs + 1, sizeof(word));
+    assert(pixel_args != NULL);
+    for (size_t p = 0; p < n; p++) {
+      for (int k = 0; k < nargs; k++)
+        pixel_args[k] = args[k][p];
+      word last = run_prog(prog, ctx, pixel_args, nargs);
+      for (int k = 0; k < prog->nresults - 1; k++)
+        out[k * n + p] = ctx->stack[k];
+      out[(prog->nresults - 1) * n + p] = last;
+    }
+    free(pixel_args);
+    return;
+  }
+  if (n == 0)
+    return;
+  if (prog->polynomial && run_differences(prog, ctx, args, n, out)) {
+    if (prof != NULL)
+      prof->differenced += n;
+    return;
+  }
+
+  if (ctx->batch_len < prog->nslots) {
+    ctx->grows++;
+    free(ctx->batch_stack);
+    ctx->batch_len = prog->nslots;
+    ctx->batch_stack = aligned_alloc(sizeof(vword), ctx->batch_len
+                                     * sizeof(struct batch_slot));
+    assert(ctx->batch_stack != NULL);
+  }
+  if (ctx->plan_len < prog->nnodes) {
+    ctx->grows++;
+    free(ctx->plan);
+    ctx->plan_len = prog->nnodes;
+    ctx->plan = calloc(ctx->plan_len, sizeof(*ctx->plan));
+    assert(ctx->plan != NULL);
+  }
+  struct batch_slot *s = ctx->batch_stack;
+  struct node_plan *plan = ctx->plan;
+  /* for scalar_node, and for prf_node's widened operands */
+  word *scratch = ctx_words(ctx, (prog->max_depth + 1) * SLOT_LANES(8)
+                            + prog->nregs);
+
+  /*
+   * Which arguments are the same in every lane, and which the same as
+   * last time; the values cached last time can be used if the answers
+   * are the same as when they were computed.
+   */
+  bool same_prog = ctx->last_prog_id == prog->id && ctx->last_n == n;
+  bool reuse = same_prog && ctx->cache_filled;
+  bool any_stable = false;
+  unsigned long uniform_args = 0, stable_args = 0;
+  assert(nargs <= 8 * sizeof(uniform_args));
+  /* the graph starts with the arguments it uses */
+  for (int i = 0; i < prog->nnodes && prog->nodes[i].op == OP_ARG; i++) {
+    int k = prog->nodes[i].arg;
+    size_t l = 1;
+    while (l < n && args[k][l] == args[k][0])
+      l++;
+    if (l == n)
+      uniform_args |= 1UL << k;
+    if (same_prog && memcmp(args[k], ctx->last_args + k * n,
+                            n * sizeof(word)) == 0) {
+      stable_args |= 1UL << k;
+      any_stable = true;
+    }
+  }
+  if (uniform_args != ctx->cache_uniform || stable_args != ctx->cache_stable)
+    reuse = false;
+
+  size_t ncached = 0;
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    struct node_plan *p = &plan[i];
+
+    if (nd->op == OP_ARG) {
+      p->uniform = uniform_args >> nd->arg & 1;
+      p->stable = stable_args >> nd->arg & 1;
+    } else {
+      p->uniform = p->stable = true;
+      int operands[] = { nd->lhs, nd->rhs };
+      for (int k = 0; k < 2 + nd->prf_n; k++) {
+        int o = (k < 2) ? operands[k]
+          : prog->prf_operands[nd->prf_first + k - 2];
+        if (o >= 0) {
+          p->uniform &= plan[o].uniform;
+          p->stable &= plan[o].stable;
+        }
+      }
+    }
+    p->needed = false;
+    p->cache_index = -1;
+    if (p->uniform)
+      p->how = NODE_SCALAR;
+    else if (p->stable && reuse)
+      p->how = NODE_CACHED;
+    else
+      p->how = NODE_VECTOR;
+  }
+
+  /* values cached in lanes of another width are computed afresh */
+  int bits = narrow_bits(prog, ctx, plan, args, n);
+  if (bits != ctx->cache_bits)
+    for (int i = 0; i < prog->nnodes; i++)
+      if (plan[i].how == NODE_CACHED)
+        plan[i].how = NODE_VECTOR;
+
+  /* cache stable values where per-pixel work starts, and the result */
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    bool vector = plan[i].how == NODE_VECTOR;
+    bool unstable = !plan[i].stable;
+    int operands[] = { nd->lhs, nd->rhs };
+    for (int k = 0; k < 2 + nd->prf_n; k++) {
+      int o = (k < 2) ? operands[k]
+        : prog->prf_operands[nd->prf_first + k - 2];
+      if (o < 0)
+        continue;
+      if (vector)
+        plan[o].needed = true;
+      if (unstable && plan[o].stable && !plan[o].uniform
+          && plan[o].cache_index < 0)
+        plan[o].cache_index = ncached++;
+    }
+  }
+  for (int k = 0; k < prog->nresults; k++) {
+    struct node_plan *result = &plan[prog->results[k]];
+    result->needed = true;
+    if (result->stable && !result->uniform && result->cache_index < 0)
+      result->cache_index = ncached++;
+  }
+  if (!any_stable)
+    ncached = 0;
+  grow_words(ctx, &ctx->cache, &ctx->cache_len, ncached * n);
+
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    if (plan[i].how != NODE_SCALAR)
+      continue;
+    uint64_t start = (prof != NULL) ? profile_clock() : 0;
+    plan[i].scalar = scalar_node(prog, nd, plan, scratch, args);
+    if (prof != NULL && nd->op != OP_ARG) {
+      prof->ops[nd->op]++;
+      if (nd->op == OP_PRF)
+        profile_prf(prof, 1, nd->prf_n, start);
+    }
+  }
+
+  /* hash the words every lane's stack starts with once; see prf_node */
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    struct node_plan *p = &plan[i];
+    if (nd->op != OP_PRF || p->how != NODE_VECTOR)
+      continue;
+    p->prf_prefix = 0;
+    while (p->prf_prefix < nd->prf_n) {
+      int o = prog->prf_operands[nd->prf_first + p->prf_prefix];
+      if (plan[o].how != NODE_SCALAR)
+        break;
+      scratch[p->prf_prefix++] = plan[o].scalar;
+    }
+    p->prf_state = prf_start;
+    siphash_absorb(&p->prf_state, (const uint64_t *)scratch, p->prf_prefix);
+  }
+
+  size_t block = SLOT_LANES(bits);
+  for (size_t first = 0; first < n; first += block) {
+    size_t nlanes = (n - first < block) ? n - first : block;
+
+    for (int i = 0; i < prog->nnodes; i++) {
+      const struct dc_node *nd = &prog->nodes[i];
+      struct node_plan *p = &plan[i];
+      struct batch_slot *slot = &s[nd->slot];
+
+      switch (p->how) {
+      case NODE_VECTOR:
+        if (nd->op == OP_ARG) {
+          load_lanes(slot, &args[nd->arg][first], nlanes, bits);
+        } else if (prof != NULL) {
+          uint64_t start = profile_clock();
+          batch_node(prog, nd, p, s, scratch, nlanes, bits);
+          prof->ops[nd->op] += nlanes;
+          if (nd->op == OP_PRF)
+            profile_prf(prof, nlanes, nd->prf_n - p->prf_prefix, start);
+        } else {
+          batch_node(prog, nd, p, s, scratch, nlanes, bits);
+        }
+        if (ncached > 0 && p->cache_index >= 0)
+          store_lanes(ctx->cache + p->cache_index * n + first, slot, nlanes,
+                      bits);
+        break;
+      case NODE_SCALAR:
+        if (p->needed)
+          fill_lanes(slot, p->scalar, bits);
+        break;
+      case NODE_CACHED:
+        if (p->needed)
+          load_lanes(slot, ctx->cache + p->cache_index * n + first, nlanes,
+                     bits);
+        break;
+      }
+    }
+    for (int k = 0; k < prog->nresults; k++)
+      store_lanes(out + k * n + first, &s[prog->nodes[prog->results[k]].slot],
+                  nlanes, bits);
+  }
+  if (prof != NULL && bits < 64)
+    prof->narrowed[(bits == 32) ? 0 : (bits == 16) ? 1 : 2] += n;
+
+  /* remember this call, for the next */
+  grow_words(ctx, &ctx->last_args, &ctx->last_args_len, nargs * n);
+  for (int i = 0; i < prog->nnodes && prog->nodes[i].op == OP_ARG; i++) {
+    int k = prog->nodes[i].arg;
+    memcpy(ctx->last_args + k * n, args[k], n * sizeof(word));
+  }
+  ctx->last_prog_id = prog->id;
+  ctx->last_n = n;
+  ctx->cache_filled = ncached > 0;
+  ctx->cache_uniform = uniform_args;
+  ctx->cache_stable = stable_args;
+  ctx->cache_bits = bits;
+}
+
+void
+run_prog_batch(const struct dc_prog *prog, struct dc_ctx *ctx,
+               const word *const args[], int nargs, size_t n, word *out)
+{
+  assert(nargs == prog->nargs);
+
+  if (prog->profile == NULL) {
+    eval_batch(prog, ctx, args, nargs, n, out);
+    return;
+  }
+
+  struct dc_profile prof = { .calls = 1, .pixels = n };
+  unsigned long grows = ctx->grows;
+  uint64_t start = profile_clock();
+  ctx->profile = &prof;
+  eval_batch(prog, ctx, args, nargs, n, out);
+  ctx->profile = NULL;
+  prof.total_ns = profile_clock() - start;
+  prof.grows = ctx->grows - grows;
+  add_profile(prog->profile, &prof);
+}
+
+/*
+ * Periodicity: prog_periods() finds, for each argument, a period m
+ * such that the program's behaviour -- its result, and whether it
+ * fails -- depends on that argument only through its remainder mod m.
+ * A period of 1 means the argument does not matter at all, and 0 that
+ * no period was found.  Periods come from remainders and masks of
+ * polynomials in the arguments: x % c depends only on the arguments
+ * mod c when x is a polynomial that cannot overflow and does not change
+ * sign over the given ranges of the arguments, and x & (2^j - 1)
+ * depends only on them mod 2^j for any polynomial x, since arithmetic
+ * wraps mod 2^64.  Anything computed from periodic values is periodic
+ * in turn.
+ */
+
+#define MAX_PERIOD ((word)1 << 32)
+
+static word
+gcd(word a, word b)
+{
+  while (b != 0) {
+    word t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* the period of something computed from values with periods a and b */
+static word
+combine_periods(word a, word b)
+{
+  if (a == 0 || b == 0)
+    return 0;
+  word l = a / gcd(a, b) * b;
+  return (l <= MAX_PERIOD) ? l : 0;
+}
+
+/* what is known of a node's value, beyond its periods */
+struct node_range {
+  bool poly;                    /* a polynomial in the arguments, mod 2^64 */
+  bool exact;                   /* and without overflow, within [lo, hi] */
+  word lo, hi;
+};
+
+/* r = x op y on intervals, false if it might overflow */
+static bool
+range_op(u_char op, const struct node_range *x, const struct node_range *y,
+         struct node_range *r)
+{
+  word c[4];
+  bool overflow = false;
+
+  switch (op) {
+  case OP_ADD:
+    overflow |= __builtin_add_overflow(x->lo, y->lo, &r->lo);
+    overflow |= __builtin_add_overflow(x->hi, y->hi, &r->hi);
+    return !overflow;
+  case OP_SUB:
+    overflow |= __builtin_sub_overflow(x->lo, y->hi, &r->lo);
+    overflow |= __builtin_sub_overflow(x->hi, y->lo, &r->hi);
+    return !overflow;
+  case OP_MUL:
+    overflow |= __builtin_mul_overflow(x->lo, y->lo, &c[0]);
+    overflow |= __builtin_mul_overflow(x->lo, y->hi, &c[1]);
+    overflow |= __builtin_mul_overflow(x->hi, y->lo, &c[2]);
+    overflow |= __builtin_mul_overflow(x->hi, y->hi, &c[3]);
+    r->lo = r->hi = c[0];
+    for (int k = 1; k < 4; k++) {
+      r->lo = (c[k] < r->lo) ? c[k] : r->lo;
+      r->hi = (c[k] > r->hi) ? c[k] : r->hi;
+    }
+    return !overflow;
+  default:
+    return false;
+  }
+}
+
+void
+prog_periods(const struct dc_prog *prog, const word lo[], const word hi[],
+             word periods[])
+{
+  int nargs = prog->nargs;
+
+  for (int k = 0; k < nargs; k++)
+    periods[k] = 0;
+  if (!prog->static_depth)
+    return;
+
+  word *node_periods = calloc((size_t)prog->nnodes * nargs + 1,
+                              sizeof(*node_periods));
+  struct node_range *ranges = calloc(prog->nnodes, sizeof(*ranges));
+  assert(node_periods != NULL && ranges != NULL);
+
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    word *p = node_periods + (size_t)i * nargs;
+    struct node_range *r = &ranges[i];
+    const struct node_range *x = (nd->lhs >= 0) ? &ranges[nd->lhs] : NULL;
+    const word *xp = (nd->lhs >= 0) ? node_periods + (size_t)nd->lhs * nargs
+      : NULL;
+
+    for (int k = 0; k < nargs; k++)
+      p[k] = 1;
+
+    if (nd->op == OP_ARG) {
+      if (lo[nd->arg] != hi[nd->arg])
+        p[nd->arg] = 0;
+      *r = (struct node_range){ true, true, lo[nd->arg], hi[nd->arg] };
+      continue;
+    }
+    if (nd->op == OP_PUSH) {
+      *r = (struct node_range){ true, true, nd->arg, nd->arg };
+      continue;
+    }
+
+    int operands[] = { nd->lhs, nd->rhs };
+    for (int k = 0; k < 2 + nd->prf_n; k++) {
+      int o = (k < 2) ? operands[k]
+        : prog->prf_operands[nd->prf_first + k - 2];
+      if (o >= 0)
+        for (int a = 0; a < nargs; a++)
+          p[a] = combine_periods(p[a], node_periods[(size_t)o * nargs + a]);
+    }
+
+    /* polynomials, and their remainders */
+    word modulus = 0;
+    struct node_range imm = { true, true, nd->arg, nd->arg };
+    switch (nd->op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+      r->poly = x->poly && ranges[nd->rhs].poly;
+      r->exact = x->exact && ranges[nd->rhs].exact
+        && range_op(nd->op, x, &ranges[nd->rhs], r);
+      break;
+    case OP_ADD_IMM:
+    case OP_MUL_IMM:
+      r->poly = x->poly;
+      r->exact = x->exact
+        && range_op(nd->op == OP_ADD_IMM ? OP_ADD : OP_MUL, x, &imm, r);
+      break;
+    case OP_SHL_IMM:
+      imm.lo = imm.hi = (word)1 << nd->arg;
+      r->poly = x->poly;
+      r->exact = x->exact && nd->arg < 63 && range_op(OP_MUL, x, &imm, r);
+      break;
+    case OP_MOD_IMM:
+    case OP_MOD_POW2:
+      if (x->exact && (x->lo >= 0 || x->hi <= 0))
+        modulus = (nd->op == OP_MOD_IMM) ? nd->arg : (word)1 << nd->arg;
+      break;
+    case OP_BAND_IMM:
+      if (x->poly && nd->arg >= 0 && (nd->arg & (nd->arg + 1)) == 0)
+        modulus = nd->arg + 1;
+      break;
+    }
+    if (modulus > 0 && modulus <= MAX_PERIOD)
+      for (int a = 0; a < nargs; a++)
+        p[a] = (xp[a] == 1) ? 1 : modulus;
+  }
+
+  /* the result matters, and so does each node that might fail */
+  for (int k = 0; k < nargs; k++)
+    periods[k] = 1;
+  for (int k = 0; k < prog->nresults; k++) {
+    const word *p = node_periods + (size_t)prog->results[k] * nargs;
+    for (int a = 0; a < nargs; a++)
+      periods[a] = combine_periods(periods[a], p[a]);
+  }
+  for (int i = 0; i < prog->nnodes; i++) {
+    if (!node_can_fail(prog->nodes[i].op))
+      continue;
+    for (int k = 0; k < nargs; k++)
+      periods[k] = combine_periods(periods[k],
+                                   node_periods[(size_t)i * nargs + k]);
+  }
+
+  free(node_periods);
+  free(ranges);
+}
+
+/*
+ * Ranges for narrow lanes: where each node's value lies over a batch,
+ * from those of the arguments; exact is false where nothing is known.
+ */
+static void
+node_value_range(const struct dc_node *nd, const struct node_range *ranges,
+                 struct node_range *r)
+{
+  const struct node_range *x = (nd->lhs >= 0) ? &ranges[nd->lhs] : NULL;
+  const struct node_range *y = (nd->rhs >= 0) ? &ranges[nd->rhs] : NULL;
+  struct node_range imm = { false, true, nd->arg, nd->arg };
+  word m;
+
+  *r = (struct node_range){ false, false, LONG_MIN, LONG_MAX };
+  switch (nd->op) {
+  case OP_PUSH:
+    *r = imm;
+    break;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+    r->exact = x->exact && y->exact && range_op(nd->op, x, y, r);
+    break;
+  case OP_ADD_IMM:
+  case OP_MUL_IMM:
+    r->exact = x->exact
+      && range_op(nd->op == OP_ADD_IMM ? OP_ADD : OP_MUL, x, &imm, r);
+    break;
+  case OP_SHL_IMM:
+    if (nd->arg < 63) {
+      imm.lo = imm.hi = (word)1 << nd->arg;
+      r->exact = x->exact && range_op(OP_MUL, x, &imm, r);
+    }
+    break;
+  case OP_SHR_IMM:
+    if (x->exact)
+      *r = (struct node_range){ false, true, x->lo >> nd->arg,
+                                x->hi >> nd->arg };
+    break;
+  case OP_DIV_IMM:
+  case OP_DIV_POW2:
+    m = (nd->op == OP_DIV_IMM) ? nd->arg : (word)1 << nd->arg;
+    if (x->exact && m > 0)
+      *r = (struct node_range){ false, true, x->lo / m, x->hi / m };
+    else if (x->exact && m < -1)
+      *r = (struct node_range){ false, true, x->hi / m, x->lo / m };
+    break;
+  case OP_MOD:
+  case OP_MOD_IMM:
+  case OP_MOD_POW2:
+    /* |x % m| < |m|, with the sign of x */
+    if (nd->op == OP_MOD)
+      m = (y->exact && y->lo != LONG_MIN)
+        ? ((-y->lo > y->hi) ? -y->lo : y->hi) : 0;
+    else
+      m = (nd->op == OP_MOD_POW2) ? (word)1 << nd->arg
+        : (nd->arg != LONG_MIN) ? labs(nd->arg) : 0;
+    if (m > 0) {
+      *r = (struct node_range){ false, true, -(m - 1), m - 1 };
+      if (x->exact && x->lo >= 0)
+        r->lo = 0;
+      if (x->exact && x->hi <= 0)
+        r->hi = 0;
+    }
+    break;
+  case OP_BAND:
+    if (x->exact && x->lo >= 0)
+      *r = (struct node_range){ false, true, 0, x->hi };
+    if (y->exact && y->lo >= 0 && (!r->exact || y->hi < r->hi))
+      *r = (struct node_range){ false, true, 0, y->hi };
+    break;
+  case OP_BAND_IMM:
+    if (nd->arg >= 0)
+      *r = (struct node_range){ false, true, 0, nd->arg };
+    break;
+  case OP_PRF:
+    if (y->exact && y->hi > 0)
+      *r = (struct node_range){ false, true, 0, y->hi - 1 };
+    break;
+  case OP_NOT: case OP_OR: case OP_AND:
+  case OP_EQ: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+    *r = (struct node_range){ false, true, 0, 1 };
+    break;
+  }
+}
+
+/* whether values in r fit in signed lanes of the given number of bits */
+static bool
+fits_bits(const struct node_range *r, int bits)
+{
+  word limit = (word)1 << (bits - 1);
+  return r->exact && r->lo >= -limit && r->hi < limit;
+}
+
+/*
+ * The narrowest lanes, of 32, 16 or 8 bits, in which a batch of prog
+ * over these arguments gets the low result_bits of each result right,
+ * or 64 for full words.  Values computed once per call are computed as
+ * words anyway.  Each other value must fit in the lanes or have no
+ * more bits demanded of it than they hold; either way, its lanes then
+ * hold all the bits it is used for.  Operands of anything but a
+ * low_bits_op must fit, so that they are exact, and the operation
+ * sees what it would in full words.
+ */
+static int
+narrow_bits(const struct dc_prog *prog, struct dc_ctx *ctx,
+            const struct node_plan *plan, const word *const args[], size_t n)
+{
+  if (ctx->ranges_len < prog->nnodes) {
+    ctx->grows++;
+    free(ctx->ranges);
+    ctx->ranges_len = prog->nnodes;
+    ctx->ranges = calloc(ctx->ranges_len, sizeof(*ctx->ranges));
+    assert(ctx->ranges != NULL);
+  }
+  struct node_range *ranges = ctx->ranges;
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    if (nd->op != OP_ARG) {
+      node_value_range(nd, ranges, &ranges[i]);
+      continue;
+    }
+    const word *a = args[nd->arg];
+    word lo = a[0], hi = a[0];
+    for (size_t l = 1; l < n && !plan[i].uniform; l++) {
+      lo = (a[l] < lo) ? a[l] : lo;
+      hi = (a[l] > hi) ? a[l] : hi;
+    }
+    ranges[i] = (struct node_range){ false, true, lo, hi };
+  }
+
+  int bits;
+  for (bits = 8; bits < 64; bits *= 2) {
+    bool ok = true;
+    for (int k = 0; k < prog->nresults && ok; k++) {
+      int i = prog->results[k];
+      ok = fits_bits(&ranges[i], bits) || prog->nodes[i].demanded <= bits;
+    }
+    for (int i = 0; i < prog->nnodes && ok; i++) {
+      const struct dc_node *nd = &prog->nodes[i];
+      if (plan[i].uniform)
+        continue;
+      ok = fits_bits(&ranges[i], bits) || nd->demanded <= bits;
+      int operands[] = { nd->lhs, nd->rhs };
+      for (int k = 0; k < 2 + nd->prf_n && ok; k++) {
+        int o = (k < 2) ? operands[k]
+          : prog->prf_operands[nd->prf_first + k - 2];
+        if (o >= 0)
+          ok = fits_bits(&ranges[o], bits)
+            || (low_bits_op(nd->op) && prog->nodes[o].demanded <= bits);
+      }
+    }
+    if (ok)
+      break;
+  }
+  return bits;
+}
+
+/*
+ * Finite differences.  A program that takes the remainder of a
+ * polynomial in its arguments by a constant, as "d* 7* 1000003%" does,
+ * computes a polynomial in the lane number over any batch in which
+ * each argument goes up by a constant from lane to lane, as col and i
+ * do along a row.  If the polynomial cannot overflow or change sign
+ * over the batch, run_differences evaluates it in the first d+1 lanes,
+ * for degree d, and steps across the rest by adding forward
+ * differences mod the constant, each sum reduced with a compare and a
+ * subtraction rather than the division a remainder per lane costs.  A
+ * fused program qualifies if each of its results does.
+ */
+
+#define MAX_POLY_DEGREE 4
+
+static bool
+is_poly_op(u_char op)
+{
+  switch (op) {
+  case OP_ARG: case OP_PUSH: case OP_ADD: case OP_SUB: case OP_MUL:
+  case OP_ADD_IMM: case OP_MUL_IMM: case OP_SHL_IMM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void
+find_polynomial(struct dc_prog *prog)
+{
+  /* nothing else may be left to fail, so all but the results are polynomial */
+  int *degree = calloc(prog->nnodes, sizeof(*degree));
+  assert(degree != NULL);
+  for (int k = 0; k < prog->nresults; k++)
+    if (prog->nodes[prog->results[k]].op != OP_PUSH)
+      degree[prog->results[k]] = -1;
+  bool ok = true;
+  for (int i = 0; i < prog->nnodes && ok; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    int x = (nd->lhs >= 0) ? degree[nd->lhs] : 0;
+    int y = (nd->rhs >= 0) ? degree[nd->rhs] : 0;
+
+    ok = x >= 0 && y >= 0;
+    if (degree[i] < 0)
+      ok &= nd->op == OP_MOD_IMM && nd->arg > 0;
+    else if (nd->op == OP_ARG)
+      degree[i] = 1;
+    else if (nd->op == OP_MUL)
+      degree[i] = x + y;
+    else
+      degree[i] = (x > y) ? x : y;
+    ok &= (degree[i] < 0 || is_poly_op(nd->op))
+      && degree[i] <= MAX_POLY_DEGREE;
+    if (degree[i] < 0 && x > prog->poly_degree)
+      prog->poly_degree = x;
+  }
+  prog->polynomial = ok;
+  free(degree);
+}
+
+/* false if the batch does not fit the conditions above */
+static bool
+run_differences(const struct dc_prog *prog, struct dc_ctx *ctx,
+                const word *const args[], size_t n, word *out)
+{
+  int d = prog->poly_degree;
+  size_t npoints = d + 1;
+
+  if (n < npoints)
+    return false;
+
+  /* the graph starts with the arguments it uses */
+  for (int i = 0; i < prog->nnodes && prog->nodes[i].op == OP_ARG; i++) {
+    const word *a = args[prog->nodes[i].arg];
+    word step, last;
+    if (__builtin_sub_overflow(a[1], a[0], &step)
+        || __builtin_mul_overflow((word)(n - 1), step, &last)
+        || __builtin_add_overflow(a[0], last, &last))
+      return false;
+    for (size_t l = 2; l < n; l++)
+      if ((uint64_t)a[l] - (uint64_t)a[l-1] != (uint64_t)step)
+        return false;
+  }
+
+  /* the polynomials in the first lanes, and their ranges over the batch */
+  grow_words(ctx, &ctx->diffs, &ctx->diffs_len, prog->nnodes * npoints);
+  word *values = ctx->diffs;
+  struct node_range *ranges = calloc(prog->nnodes, sizeof(*ranges));
+  assert(ranges != NULL);
+  for (int i = 0; i < prog->nnodes; i++) {
+    const struct dc_node *nd = &prog->nodes[i];
+    word *v = values + i * npoints;
+    const word *x = values + nd->lhs * npoints;
+    const word *y = values + nd->rhs * npoints;
+    struct node_range *r = &ranges[i];
+    struct node_range imm = { true, true, nd->arg, nd->arg };
+
+    switch (nd->op) {
+    case OP_ARG: {
+      const word *a = args[nd->arg];
+      memcpy(v, a, npoints * sizeof(word));
+      r->lo = (a[0] < a[n-1]) ? a[0] : a[n-1];
+      r->hi = (a[0] < a[n-1]) ? a[n-1] : a[0];
+      r->exact = true;
+      break;
+    }
+    case OP_PUSH:
+      for (size_t q = 0; q < npoints; q++)
+        v[q] = nd->arg;
+      *r = imm;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+      for (size_t q = 0; q < npoints; q++)
+        v[q] = fold_binary(nd->op, x[q], y[q]);
+      r->exact = ranges[nd->lhs].exact && ranges[nd->rhs].exact
+        && range_op(nd->op, &ranges[nd->lhs], &ranges[nd->rhs], r);
+      break;
+    case OP_MOD_IMM:
+      /* a result; the remainders are taken below */
+      break;
+    case OP_SHL_IMM:
+      imm.lo = imm.hi = (nd->arg < 63) ? (word)1 << nd->arg : 0;
+      /* FALLTHROUGH */
+    default:
+      for (size_t q = 0; q < npoints; q++)
+        v[q] = fold_binary(nd->op, x[q], nd->arg);
+      r->exact = ranges[nd->lhs].exact
+        && !(nd->op == OP_SHL_IMM && nd->arg >= 63)
+        && range_op(nd->op == OP_ADD_IMM ? OP_ADD : OP_MUL,
+                    &ranges[nd->lhs], &imm, r);
+      break;
+    }
+  }
+
+  bool ok = true;
+  for (int k = 0; k < prog->nresults && ok; k++) {
+    const struct dc_node *result = &prog->nodes[prog->results[k]];
+    if (result->op != OP_PUSH) {
+      const struct node_range *r = &ranges[result->lhs];
+      ok = r->exact && (r->lo >= 0 || r->hi <= 0);
+    }
+  }
+  if (!ok) {
+    free(ranges);
+    return false;
+  }
+
+  for (int k = 0; k < prog->nresults; k++) {
+    const struct dc_node *result = &prog->nodes[prog->results[k]];
+    word *o = out + k * n;
+
+    if (result->op == OP_PUSH) {
+      for (size_t p = 0; p < n; p++)
+        o[p] = result->arg;
+      continue;
+    }
+
+    const struct node_range *poly = &ranges[result->lhs];
+    const word *v = values + result->lhs * npoints;
+    uint64_t m = result->arg;
+    uint64_t diffs[MAX_POLY_DEGREE + 1];
+
+    /* residues in the first lanes, then their forward differences */
+    for (size_t q = 0; q < npoints; q++)
+      diffs[q] = ((uint64_t)(v[q] % (word)m) + m) % m;
+    for (int j = 1; j <= d; j++)
+      for (int q = d; q >= j; q--)
+        diffs[q] = (diffs[q] >= diffs[q-1]) ? diffs[q] - diffs[q-1]
+          : diffs[q] + m - diffs[q-1];
+
+    /* a remainder of something negative is negative in C */
+    uint64_t bias = (poly->hi <= 0) ? m : 0;
+#define STEP(j)                                                 \
+    do {                                                        \
+      diffs[j] += diffs[(j)+1];                                 \
+      diffs[j] -= (diffs[j] >= m) ? m : 0;                      \
+    } while (0)
+    for (size_t p = 0; p < n; p++) {
+      o[p] = (diffs[0] != 0) ? (word)(diffs[0] - bias) : 0;
+      switch (d) {
+      case 0:
+        break;
+      case 1:
+        STEP(0);
+        break;
+      case 2:
+        STEP(0);
+        STEP(1);
+        break;
+      default:
+        for (int j = 0; j < d; j++)
+          STEP(j);
+        break;
+      }
+    }
+#undef STEP
+  }
+  free(ranges);
+  return true;
+}
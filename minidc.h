@@ -18,7 +18,31 @@ typedef long word;
 
 #define PRF_KEYLEN 16
 void init_dc(uint8_t *prf_key_val);
+int select_prf(const char *name);
+const char *prf_name(void);
+void get_prf_key(uint8_t *key);
 void reset_for_prog(char *prog);
 void push(word value);
 word pop(void);
 void eval(void);
+
+struct dc_prog;
+struct dc_ctx;
+struct dc_prog *compile_prog(const char *text, int nargs, int nresults);
+struct dc_prog *fuse_progs(struct dc_prog *const progs[], int nprogs, int nargs,
+                           int fixed_arg);
+struct dc_ctx *new_ctx(void);
+word run_prog(const struct dc_prog *prog, struct dc_ctx *ctx,
+              const word *args, int nargs);
+void run_prog_batch(const struct dc_prog *prog, struct dc_ctx *ctx,
+                    const word *const args[], int nargs, size_t n, word *out);
+const char *prog_error(const struct dc_prog *prog);
+void prog_periods(const struct dc_prog *prog, const word lo[], const word hi[],
+                  word periods[]);
+void prog_insn_counts(const struct dc_prog *prog, size_t *before,
+                      size_t *after);
+void prog_result_bits(struct dc_prog *prog, int bits);
+void prog_profile(struct dc_prog *prog);
+void print_profile(FILE *f, const char *name, const struct dc_prog *prog);
+void free_prog(struct dc_prog *prog);
+void free_ctx(struct dc_ctx *ctx);
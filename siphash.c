@@ -183,3 +183,200 @@ int siphash(const void *in, const size_t inlen, const void *k, uint8_t *out,
 
     return 0;
 }
+
+/*
+    Starts a hash to be fed whole 64-bit words by siphash_absorb, so that
+    the state after a common prefix can be kept and continued from
+    *st: the state to set up
+    *k: pointer to the key data (read-only), must be 16 bytes
+    crounds, drounds: the rounds per word and at the end, 2 and 4 for
+    SipHash-2-4 as siphash() computes it, or 1 and 3 for SipHash-1-3
+*/
+void siphash_init(struct siphash_state *st, const void *k, int crounds,
+                  int drounds) {
+
+    const unsigned char *kk = (const unsigned char *)k;
+    uint64_t k0 = U8TO64_LE(kk);
+    uint64_t k1 = U8TO64_LE(kk + 8);
+
+    st->v0 = UINT64_C(0x736f6d6570736575) ^ k0;
+    st->v1 = UINT64_C(0x646f72616e646f6d) ^ k1;
+    st->v2 = UINT64_C(0x6c7967656e657261) ^ k0;
+    st->v3 = UINT64_C(0x7465646279746573) ^ k1;
+    st->nwords = 0;
+    st->crounds = crounds;
+    st->drounds = drounds;
+}
+
+/*
+    Absorbs nwords 64-bit words, as siphash() would the 8-byte chunks of
+    their bytes on a little-endian host
+*/
+void siphash_absorb(struct siphash_state *st, const uint64_t *words,
+                    const size_t nwords) {
+
+    uint64_t v0 = st->v0, v1 = st->v1, v2 = st->v2, v3 = st->v3;
+    uint64_t m;
+    size_t i;
+    int r;
+
+    for (i = 0; i < nwords; i++) {
+        m = words[i];
+        v3 ^= m;
+
+        for (r = 0; r < st->crounds; ++r)
+            SIPROUND;
+
+        v0 ^= m;
+    }
+
+    st->v0 = v0;
+    st->v1 = v1;
+    st->v2 = v2;
+    st->v3 = v3;
+    st->nwords += nwords;
+}
+
+/*
+    The 8-byte SipHash value of the words absorbed so far, as siphash()
+    would write it; st is left as it was, to be continued again
+*/
+uint64_t siphash_finish(const struct siphash_state *st) {
+
+    uint64_t v0 = st->v0, v1 = st->v1, v2 = st->v2, v3 = st->v3;
+    uint64_t b = ((uint64_t)st->nwords * 8) << 56;
+    int r;
+
+    v3 ^= b;
+
+    for (r = 0; r < st->crounds; ++r)
+        SIPROUND;
+
+    v0 ^= b;
+    v2 ^= 0xff;
+
+    for (r = 0; r < st->drounds; ++r)
+        SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+   The same rounds on four states at once, one per 64-bit lane of a
+   256-bit vector; siphash_batch keeps two sets in flight, so that one
+   set's dependent instructions overlap the other's.  On x86-64 there is
+   also an AVX2 copy of the function, used where the CPU has AVX2;
+   elsewhere the compiler splits the vectors as the target needs.
+ */
+typedef uint64_t sipvec __attribute__((vector_size(32)));
+
+#if defined(__x86_64__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+#define VROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND_VEC(v0, v1, v2, v3)                                           \
+    do {                                                                       \
+        v0 += v1;                                                              \
+        v1 = VROTL(v1, 13);                                                    \
+        v1 ^= v0;                                                              \
+        v0 = VROTL(v0, 32);                                                    \
+        v2 += v3;                                                              \
+        v3 = VROTL(v3, 16);                                                    \
+        v3 ^= v2;                                                              \
+        v0 += v3;                                                              \
+        v3 = VROTL(v3, 21);                                                    \
+        v3 ^= v0;                                                              \
+        v2 += v1;                                                              \
+        v1 = VROTL(v1, 17);                                                    \
+        v1 ^= v2;                                                              \
+        v2 = VROTL(v2, 32);                                                    \
+    } while (0)
+
+#define SIPROUND_BATCH                                                         \
+    do {                                                                       \
+        SIPROUND_VEC(v0, v1, v2, v3);                                          \
+        SIPROUND_VEC(w0, w1, w2, w3);                                          \
+    } while (0)
+
+/*
+    Continues SIPHASH_BATCH copies of a hash, absorbing nwords more
+    words into each, and computes their 8-byte values, four lanes of a
+    vector at a time
+    *prefix: the state the messages start from (read-only)
+    *in: the rest of the messages, nwords 64-bit words each, interleaved:
+    word w of message l is in[w * stride + l]
+    nwords: the number of words to absorb
+    stride: the distance between words of a message, at least
+    SIPHASH_BATCH
+    *out: the hash of message l goes to out[l]
+*/
+BATCH_CLONES
+void siphash_batch_from(const struct siphash_state *prefix, const uint64_t *in,
+                        const size_t nwords, const size_t stride,
+                        uint64_t *out) {
+
+    sipvec v0 = (sipvec){0} + prefix->v0;
+    sipvec v1 = (sipvec){0} + prefix->v1;
+    sipvec v2 = (sipvec){0} + prefix->v2;
+    sipvec v3 = (sipvec){0} + prefix->v3;
+    sipvec w0 = v0, w1 = v1, w2 = v2, w3 = v3;
+    sipvec m, n;
+    uint64_t b = ((uint64_t)(prefix->nwords + nwords) * 8) << 56;
+    size_t i;
+    int r;
+
+    for (i = 0; i < nwords; i++) {
+        memcpy(&m, in + i * stride, sizeof(m));
+        memcpy(&n, in + i * stride + 4, sizeof(n));
+        v3 ^= m;
+        w3 ^= n;
+
+        for (r = 0; r < prefix->crounds; ++r)
+            SIPROUND_BATCH;
+
+        v0 ^= m;
+        w0 ^= n;
+    }
+
+    v3 ^= b;
+    w3 ^= b;
+
+    for (r = 0; r < prefix->crounds; ++r)
+        SIPROUND_BATCH;
+
+    v0 ^= b;
+    w0 ^= b;
+    v2 ^= 0xff;
+    w2 ^= 0xff;
+
+    for (r = 0; r < prefix->drounds; ++r)
+        SIPROUND_BATCH;
+
+    m = v0 ^ v1 ^ v2 ^ v3;
+    n = w0 ^ w1 ^ w2 ^ w3;
+    memcpy(out, &m, sizeof(m));
+    memcpy(out + 4, &n, sizeof(n));
+}
+
+/*
+    Computes the 8-byte SipHash values of SIPHASH_BATCH messages of the
+    same length at once, with the same key
+    *in: the messages, nwords 64-bit words each, interleaved: word w of
+    message l is in[w * SIPHASH_BATCH + l]
+    nwords: length of each message in 64-bit words
+    *k: pointer to the key data (read-only), must be 16 bytes
+    *out: the hash of message l goes to out[l], as the 8 bytes that
+    siphash() would write for the words' bytes, on a little-endian host
+*/
+void siphash_batch(const uint64_t *in, const size_t nwords, const void *k,
+                   uint64_t *out) {
+
+    struct siphash_state st;
+
+    siphash_init(&st, k, cROUNDS, dROUNDS);
+    siphash_batch_from(&st, in, nwords, SIPHASH_BATCH, out);
+}
@@ -20,3 +20,28 @@
 
 int siphash(const void *in, const size_t inlen, const void *k, uint8_t *out,
             const size_t outlen);
+
+/*
+   A SipHash-2-4 or SipHash-1-3 hash with 8-byte output, fed whole
+   64-bit words at a time; crounds and drounds say which
+*/
+struct siphash_state {
+    uint64_t v0, v1, v2, v3;
+    size_t nwords;
+    int crounds, drounds;
+};
+
+void siphash_init(struct siphash_state *st, const void *k, int crounds,
+                  int drounds);
+void siphash_absorb(struct siphash_state *st, const uint64_t *words,
+                    const size_t nwords);
+uint64_t siphash_finish(const struct siphash_state *st);
+
+/* messages hashed at once by siphash_batch */
+#define SIPHASH_BATCH 8
+
+void siphash_batch(const uint64_t *in, const size_t nwords, const void *k,
+                   uint64_t *out);
+void siphash_batch_from(const struct siphash_state *prefix, const uint64_t *in,
+                        const size_t nwords, const size_t stride,
+                        uint64_t *out);
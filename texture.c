@@ -0,0 +1,208 @@
+/*
+ * Copyright 2023 Hovav Shacham.  All rights reserved; see LICENSE file.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "minidc.h"
+#include "texture.h"
+
+/*
+ * Evaluate the channel programs for a whole row at once; arg_values
+ * has room for the four arguments of width pixels, and values for
+ * 4 * width results.  fused, if there is one, computes all four
+ * channels at once from row, col and i; otherwise each channel is run
+ * on its own.  Each has a context of its own, which keeps the values
+ * that depend only on col from one row to the next.
+ */
+static void
+compute_row(struct dc_prog *const progs[4], const struct dc_prog *fused,
+            struct dc_ctx *const ctxs[4], uint8_t *pixels, int width,
+            int row, word *arg_values, word *values)
+{
+  word *chans = arg_values;
+  word *rows = chans + width;
+  word *cols = rows + width;
+  word *indices = cols + width;
+  const word *args[] = { chans, rows, cols, indices };
+
+  for (int col = 0; col < width; col++) {
+    rows[col] = row;
+    cols[col] = col;
+    indices[col] = row * width + col;
+  }
+
+  if (fused != NULL) {
+    run_prog_batch(fused, ctxs[0], args + 1, 3, width, values);
+    uint8_t *pixel = pixels + 4 * row * width;
+    for (int col = 0; col < width; col++, pixel += 4)
+      for (int chan = 0; chan < 4; chan++)
+        pixel[chan] = values[chan * width + col] & 0xff;
+    return;
+  }
+
+  for (int chan = 0; chan < 4; chan++) {
+    uint8_t *channel = pixels + 4 * row * width + chan;
+
+    if (progs[chan] == NULL) {
+      for (int col = 0; col < width; col++)
+        channel[4*col] = 0;
+      continue;
+    }
+
+    for (int col = 0; col < width; col++)
+      chans[col] = chan;        /* prf domain separation */
+    run_prog_batch(progs[chan], ctxs[chan], args, 4, width, values);
+    for (int col = 0; col < width; col++)
+      channel[4*col] = values[col] & 0xff;
+  }
+}
+
+/* rows [first_row, end_row) of the texture, for one thread */
+struct row_job {
+  pthread_t thread;
+  struct dc_prog *const *progs;
+  const struct dc_prog *fused;
+  uint8_t *pixels;
+  int width;
+  int first_row;
+  int end_row;
+};
+
+static void *
+compute_rows(void *arg)
+{
+  struct row_job *job = arg;
+  struct dc_ctx *ctxs[4];
+  for (int chan = 0; chan < 4; chan++)
+    ctxs[chan] = new_ctx();
+  word *arg_values = malloc(4 * job->width * sizeof(word));
+  word *values = malloc(4 * job->width * sizeof(word));
+  assert(arg_values != NULL && values != NULL);
+
+  for (int row = job->first_row; row < job->end_row; row++)
+    compute_row(job->progs, job->fused, ctxs, job->pixels, job->width, row,
+                arg_values, values);
+
+  free(arg_values);
+  free(values);
+  for (int chan = 0; chan < 4; chan++)
+    free_ctx(ctxs[chan]);
+  return NULL;
+}
+
+/*
+ * Rows [0, nrows) of a texture width pixels wide, into pixels, with
+ * nthreads threads (0 for one per CPU).  Every pixel depends only on
+ * its own coordinates, so each thread takes a band of rows.
+ */
+void
+compute_texture_rows(struct dc_prog *const progs[4],
+                     const struct dc_prog *fused, uint8_t *pixels,
+                     int width, int nrows, int nthreads)
+{
+  if (nthreads < 1)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > nrows)
+    nthreads = nrows;
+  struct row_job *jobs = calloc(nthreads, sizeof(*jobs));
+  assert(jobs != NULL);
+
+  int rv;
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].progs = progs;
+    jobs[t].fused = fused;
+    jobs[t].pixels = pixels;
+    jobs[t].width = width;
+    jobs[t].first_row = (long)nrows * t / nthreads;
+    jobs[t].end_row = (long)nrows * (t+1) / nthreads;
+    rv = pthread_create(&jobs[t].thread, NULL, compute_rows, &jobs[t]);
+    assert(rv == 0);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    rv = pthread_join(jobs[t].thread, NULL);
+    assert(rv == 0);
+  }
+
+  free(jobs);
+}
+
+static long
+lcm(long a, long b)
+{
+  long x = a, y = b;
+  while (y != 0) {
+    long t = x % y;
+    x = y;
+    y = t;
+  }
+  return a / x * b;
+}
+
+/*
+ * The period in pixels of the width by height texture the channel
+ * programs or the RGBA program describe, or 0 if none is found.  Since
+ * row = i / width and col = i % width, a period of m in i carries over
+ * as it is, one in col gives width (or m, if that divides width), and
+ * one in row gives m * width.
+ */
+long
+texture_period(struct dc_prog *const progs[4], const struct dc_prog *rgba,
+               int width, int height)
+{
+  long npixels = (long)width * height;
+  long period = 1;
+
+  for (int chan = 0; chan < 5; chan++) {
+    const struct dc_prog *prog = (chan < 4) ? progs[chan] : rgba;
+    if (prog == NULL)
+      continue;
+
+    /* the RGBA program is not given chan */
+    int skip = (chan == 4);
+    word lo[4] = { chan, 0, 0, 0 };
+    word hi[4] = { chan, height - 1, width - 1, npixels - 1 };
+    word periods[4];
+    prog_periods(prog, lo + skip, hi + skip, periods + skip);
+    if (periods[1] == 0 || periods[3] == 0)
+      return 0;
+
+    long row_period = (periods[1] == 1) ? 1 : periods[1] * width;
+    long col_period = periods[2];
+    if (col_period == 0 || width % col_period != 0)
+      col_period = width;
+    period = lcm(period, row_period);
+    if (period <= npixels)
+      period = lcm(period, col_period);
+    if (period <= npixels)
+      period = lcm(period, periods[3]);
+    if (period > npixels)
+      return 0;
+  }
+  return period;
+}
+
+/*
+ * Fill in a texture from its first done pixels, given that they repeat
+ * every period pixels.
+ */
+void
+replicate_pixels(uint8_t *pixels, int width, int height, long period,
+                 long done)
+{
+  long npixels = (long)width * height;
+  long filled = done / period * period;
+
+  while (filled < npixels) {
+    long n = (filled < npixels - filled) ? filled : npixels - filled;
+    memcpy(pixels + 4 * filled, pixels, 4 * n);
+    filled += n;
+  }
+}
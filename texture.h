@@ -0,0 +1,15 @@
+/*
+ * Copyright 2023 Hovav Shacham.  All rights reserved; see LICENSE file.
+ */
+
+/*
+ * Computing the RGBA texture that dump and tweak upload, from the four
+ * channel programs or from one program, fused or RGBA, for all four.
+ */
+void compute_texture_rows(struct dc_prog *const progs[4],
+                          const struct dc_prog *fused, uint8_t *pixels,
+                          int width, int nrows, int nthreads);
+long texture_period(struct dc_prog *const progs[4], const struct dc_prog *rgba,
+                    int width, int height);
+void replicate_pixels(uint8_t *pixels, int width, int height, long period,
+                      long done);
@@ -12,6 +12,7 @@
 #include <GL/gl.h>
 
 #include "minidc.h"
+#include "texture.h"
 
 #define MAX_CONFIGS 1
 
@@ -79,9 +80,22 @@ set_prf_seed(char *hex_seed)
   }
 }
 
+static void
+set_prf(const char *name)
+{
+  if (select_prf(name) != 0) {
+    fprintf(stderr, "tweak: no PRF %s; try siphash-2-4 or siphash-1-3\n",
+            name);
+    exit(EXIT_FAILURE);
+  }
+}
+
 static int width  = 1024;
 static int height = 512;
 static char *prefix = NULL;
+static int verbose = 0;
+static int profile = 0;
+static int nthreads = 0;         /* 0 for one per CPU */
 
 uint8_t *c2_base = NULL;
 ssize_t c2_len = -1;
@@ -141,21 +155,7 @@ static char *r_prog = NULL;
 static char *g_prog = NULL;
 static char *b_prog = NULL;
 static char *a_prog = NULL;
-
-static GLubyte
-get_prog_value_at(char *prog, int chan,
-                  int row, int col, int i)
-{
-  if (prog == NULL)
-    return 0;
-
-  reset_for_prog(prog);
-  push(chan);                   /* prf domain separation */
-  push(row); push(col); push(i);
-  eval();
-  word wval = pop();
-  return wval & 0xff;
-}
+static char *rgba_prog = NULL;  /* or all four channels at once */
 
 static GLubyte *pixels = NULL;
 static GLubyte *tweaked_pixels = NULL;
@@ -164,22 +164,99 @@ static void
 compute_pixels(void)
 {
   init_dc(minidc_prf_seed);     /* seed is NULL unless -s option given */
+  struct dc_prog *progs[4];
+  char *prog_texts[4] = { r_prog, g_prog, b_prog, a_prog };
+  for (int chan = 0; chan < 4; chan++) {
+    if (prog_texts[chan] != NULL && rgba_prog != NULL) {
+      fprintf(stderr, "tweak: -%c cannot be combined with -c\n", "rgba"[chan]);
+      exit(EXIT_FAILURE);
+    }
+    progs[chan] = prog_texts[chan] ? compile_prog(prog_texts[chan], 4, 1)
+      : NULL;
+  }
+  struct dc_prog *rgba = rgba_prog ? compile_prog(rgba_prog, 3, 4) : NULL;
+
+  /* a program that fails does so on every pixel, so say why up front */
+  for (int chan = 0; chan < 4; chan++) {
+    const char *error = progs[chan] ? prog_error(progs[chan]) : NULL;
+    if (error != NULL) {
+      fprintf(stderr, "tweak: %c_prog: %s\n", "rgba"[chan], error);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (rgba != NULL && prog_error(rgba) != NULL) {
+    fprintf(stderr, "tweak: rgba_prog: %s\n", prog_error(rgba));
+    exit(EXIT_FAILURE);
+  }
+
+  if (verbose) {
+    for (int chan = 0; chan < 4; chan++) {
+      if (progs[chan] == NULL)
+        continue;
+      size_t before, after;
+      prog_insn_counts(progs[chan], &before, &after);
+      fprintf(stderr, "%c_prog: %zu instructions, %zu after optimization\n",
+              "rgba"[chan], before, after);
+    }
+    if (rgba != NULL) {
+      size_t before, after;
+      prog_insn_counts(rgba, &before, &after);
+      fprintf(stderr, "rgba_prog: %zu instructions, %zu after optimization\n",
+              before, after);
+    }
+  }
+
+  /* the channels are computed together, unless some program cannot be */
+  struct dc_prog *fused = rgba ? rgba : fuse_progs(progs, 4, 4, 0);
+
+  /* only the low byte of each channel is kept */
+  if (fused != NULL)
+    prog_result_bits(fused, 8);
+  for (int chan = 0; chan < 4; chan++)
+    if (progs[chan] != NULL)
+      prog_result_bits(progs[chan], 8);
+  if (profile) {
+    if (fused != NULL)
+      prog_profile(fused);
+    for (int chan = 0; chan < 4; chan++)
+      if (fused == NULL && progs[chan] != NULL)
+        prog_profile(progs[chan]);
+  }
 
   pixels = malloc(width * height * 4);
   assert(pixels != NULL);
   tweaked_pixels = malloc(width * height * 4);
   assert(tweaked_pixels != NULL);
 
-  int i = 0;
-  for (int row = 0; row < height; row++) {
-    for (int col = 0; col < width; col++) {
-      pixels[4*i+0] = get_prog_value_at(r_prog, 0, row, col, i);
-      pixels[4*i+1] = get_prog_value_at(g_prog, 1, row, col, i);
-      pixels[4*i+2] = get_prog_value_at(b_prog, 2, row, col, i);
-      pixels[4*i+3] = get_prog_value_at(a_prog, 3, row, col, i);
-      i++;
+  /* a periodic texture is computed for one period, then copied */
+  int nrows = height;
+  long period = texture_period(progs, rgba, width, height);
+  if (period > 0 && (period + width - 1) / width < height)
+    nrows = (period + width - 1) / width;
+  if (verbose && nrows < height)
+    fprintf(stderr, "texture repeats every %ld pixels; "
+            "computing %d of %d rows\n", period, nrows, height);
+
+  compute_texture_rows(progs, fused, pixels, width, nrows, nthreads);
+  if (nrows < height)
+    replicate_pixels(pixels, width, height, period, (long)nrows * width);
+
+  if (profile) {
+    if (fused != NULL)
+      print_profile(stderr, rgba ? "rgba_prog" : "channels", fused);
+    for (int chan = 0; chan < 4; chan++) {
+      char name[] = "?_prog";
+      name[0] = "rgba"[chan];
+      if (fused == NULL && progs[chan] != NULL)
+        print_profile(stderr, name, progs[chan]);
     }
   }
+
+  if (fused != NULL)
+    free_prog(fused);
+  for (int chan = 0; chan < 4; chan++)
+    if (progs[chan] != NULL)
+      free_prog(progs[chan]);
 }
 
 static void
@@ -192,10 +269,17 @@ make_tweaks(int argc, char *argv[])
     char *tweak_prog = argv[i+1];
     assert(pos >=0 && pos < c2_len);
 
-    reset_for_prog(tweak_prog);
-    push(c2_base[pos]);
-    eval();
-    word wval = pop();
+    struct dc_prog *prog = compile_prog(tweak_prog, 1, 1);
+    if (prog_error(prog) != NULL) {
+      fprintf(stderr, "tweak: tweak program for %d: %s\n", pos,
+              prog_error(prog));
+      exit(EXIT_FAILURE);
+    }
+    struct dc_ctx *ctx = new_ctx();
+    word arg = c2_base[pos];
+    word wval = run_prog(prog, ctx, &arg, 1);
+    free_ctx(ctx);
+    free_prog(prog);
     c2_base[pos] = wval & 0xff;
   }
 }
@@ -226,8 +310,10 @@ dump_tweaked_pixels(void)
 static void
 usage(void)
 {
-  fprintf(stderr, "Usage: tweak [-p prefix] [-s seed] [-w width] [-h height]\n"
+  fprintf(stderr, "Usage: tweak [-v] [-P] [-j threads] [-p prefix] [-s seed]\n"
+                  "             [-H prf] [-w width] [-h height]\n"
                   "             [-r r_prog] [-g g_prog] [-b b_prog] [-a a_prog]\n"
+                  "             [-c rgba_prog]\n"
                   "             [pos1 tweakprog1] [pos2 tweakprog2] ...\n");
   exit(EXIT_FAILURE);
 }
@@ -237,8 +323,18 @@ parse_args(int argc, char *argv[])
 {
   int opt;
 
-  while ( (opt = getopt(argc, argv, "p:s:w:h:r:g:b:a:")) != -1) {
+  while ( (opt = getopt(argc, argv, "vPj:p:s:H:w:h:r:g:b:a:c:")) != -1) {
     switch (opt) {
+    case 'v':
+      verbose = 1;
+      break;
+    case 'P':
+      profile = 1;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      assert(nthreads > 0);
+      break;
     case 'p':
       prefix = optarg;
       break;
@@ -247,6 +343,9 @@ parse_args(int argc, char *argv[])
         usage();
       set_prf_seed(optarg);
       break;
+    case 'H':
+      set_prf(optarg);
+      break;
     case 'w':
       width = atoi(optarg);
       assert(width > 0);
@@ -269,6 +368,9 @@ parse_args(int argc, char *argv[])
     case 'a':
       a_prog = optarg;
       break;
+    case 'c':
+      rgba_prog = optarg;
+      break;
     default:
       usage();
     }